@@ -5,21 +5,106 @@
 #include <thread>
 
 #include <algorithm>
+#include <iterator>
 #include <chrono>
 #include <string.h>
+#include <strings.h>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 namespace httpmock
 {
 
+namespace
+{
+
+// header names are case-insensitive
+bool containsHeader(const std::unordered_map<std::string, std::string> &headers, const std::string &name)
+{
+    if(headers.find(name) != headers.end())
+        return true;
+
+    return std::any_of(headers.begin(), headers.end(), [&name](const std::pair<const std::string, std::string> &entry)
+    {
+        return strcasecmp(entry.first.c_str(), name.c_str()) == 0;
+    });
+}
+
+// A pooled ConnectionData keeps the capacity of a usual request, but not the one of a single large upload or response
+constexpr size_t maxRetainedCapacity = 64 * 1024;
+
+template<typename Buffer>
+void clearBuffer(Buffer &buffer)
+{
+    if(buffer.capacity() > maxRetainedCapacity)
+        Buffer().swap(buffer);
+    else
+        buffer.clear();
+}
+
+}
+
+double ConnectionStatistics::requestsPerConnection() const
+{
+    return connections ? static_cast<double>(requests) / static_cast<double>(connections) : 0.0;
+}
+
+double ConnectionStatistics::reuseRatio() const
+{
+    return requests ? static_cast<double>(reusedRequests) / static_cast<double>(requests) : 0.0;
+}
+
+void ConnectionData::clear()
+{
+    mockServer = nullptr;
+    connection = nullptr;
+    postProcessor = nullptr;
+    connectionId = 0;
+    requestIndexOnConnection = 0;
+
+    url.clear();
+    version.clear();
+    httpMethod = HttpMethod::Get;
+    urlArguments.clear();
+    header.clear();
+
+    postKey.clear();
+    postFileName.clear();
+    postContentType.clear();
+    postTransferEncoding.clear();
+    postUrlEncoded.clear();
+    clearBuffer(postData);
+
+    responseHeader.clear();
+    clearBuffer(responseBody);
+    responseCode = MHD_HTTP_OK;
+    responseBodyView = std::string_view();
+    responseBodyOwner.reset();
+    requestId = 0;
+    phases = RequestPhases();
+    // responseHeaderTemplateValues is kept: the strings are overwritten by the next rendering and keep their capacity
+    for(auto &value : responseHeaderTemplateValues)
+    {
+        if(value.capacity() > maxRetainedCapacity)
+            std::string().swap(value);
+    }
+}
+
 HttpMockServer::HttpMockServer(int port)
  : m_httpServer(nullptr, &MHD_stop_daemon)
+ , m_currentConfiguration(std::make_unique<ResponseConfiguration>())
  , m_port(port)
 {
-
+    m_configuration = m_currentConfiguration.get();
 }
 
 HttpMockServer::~HttpMockServer()
 {
+    stop();
+
     while(m_callbackRunning)
     {
         std::cout << "destructor waiting for running callback in other thread ..." << std::endl;
@@ -27,18 +112,154 @@ HttpMockServer::~HttpMockServer()
     }
 }
 
-void HttpMockServer::start()
+void HttpMockServer::start(const ServerOptions &options)
 {
-    m_httpServer.reset(MHD_start_daemon(MHD_USE_AUTO | MHD_USE_INTERNAL_POLLING_THREAD, m_port, NULL, NULL,
-        &staticOnConnectionCallback, this, MHD_OPTION_NOTIFY_COMPLETED, staticOnRequestCompleted, this, MHD_OPTION_END));
+    validateOptions(options);
+    m_options = options;
+    createTracer();
+    resetConnectionStatistics();
+
+    std::vector<MHD_OptionItem> optionItems = daemonOptions(options);
+    if(options.threadPoolSize > 0)
+        optionItems.insert(optionItems.end() - 1, {MHD_OPTION_THREAD_POOL_SIZE, static_cast<intptr_t>(options.threadPoolSize), nullptr});
+
+    m_httpServer.reset(MHD_start_daemon(daemonFlags(options) | MHD_USE_INTERNAL_POLLING_THREAD, m_port, NULL, NULL,
+        &staticOnConnectionCallback, this, MHD_OPTION_NOTIFY_COMPLETED, staticOnRequestCompleted, this,
+        MHD_OPTION_NOTIFY_CONNECTION, staticOnConnectionNotify, this,
+        MHD_OPTION_ARRAY, optionItems.data(), MHD_OPTION_END));
 
     if(!m_httpServer)
         throw std::runtime_error("HttpMockServer has failed to start!");
+
+    // port 0: libmicrohttpd has bound any free port. m_port keeps the requested port, so a restart chooses a free port again.
+    m_boundPort = m_port;
+    if(m_port == 0)
+    {
+        const union MHD_DaemonInfo *info = MHD_get_daemon_info(m_httpServer.get(), MHD_DAEMON_INFO_BIND_PORT);
+        if(info)
+            m_boundPort = info->port;
+    }
+}
+
+void HttpMockServer::startOnListenSocket(int listenSocket, int cpu, const ServerOptions &options)
+{
+    validateOptions(options);
+    m_options = options;
+    createTracer();
+    resetConnectionStatistics();
+
+    // MHD_OPTION_THREAD_POOL_SIZE is never used here: the shards replace the thread pool
+    std::vector<MHD_OptionItem> optionItems = daemonOptions(options);
+
+    // No internal polling thread: the daemon is driven by runPollingLoop(), so that we are able to pin the thread.
+    m_httpServer.reset(MHD_start_daemon(daemonFlags(options), 0, NULL, NULL,
+        &staticOnConnectionCallback, this, MHD_OPTION_LISTEN_SOCKET, static_cast<MHD_socket>(listenSocket),
+        MHD_OPTION_NOTIFY_COMPLETED, staticOnRequestCompleted, this,
+        MHD_OPTION_NOTIFY_CONNECTION, staticOnConnectionNotify, this,
+        MHD_OPTION_ARRAY, optionItems.data(), MHD_OPTION_END));
+
+    if(!m_httpServer)
+        throw std::runtime_error("HttpMockServer has failed to start on listen socket!");
+
+    m_boundPort = m_port;
+    m_pollingActive = true;
+    m_pollingThread = std::thread(&HttpMockServer::runPollingLoop, this, cpu);
+}
+
+void HttpMockServer::createTracer()
+{
+    // the trace of the previous run remains available until the server is started again
+    if(m_options.traceBufferSize > 0)
+        m_tracer = std::make_unique<RequestTracer>(m_options.traceBufferSize);
+    else
+        m_tracer.reset();
+}
+
+void HttpMockServer::resetConnectionStatistics()
+{
+    std::lock_guard<std::mutex> lock(m_tcpConnectionsMutex);
+    m_openTcpConnections.clear();
+    m_closedTcpConnections.clear();
+}
+
+void HttpMockServer::validateOptions(const ServerOptions &options)
+{
+    if(options.postProcessorBufferSize < 256)
+        throw std::invalid_argument("HttpMockServer: postProcessorBufferSize must be at least 256 bytes!");
+}
+
+unsigned int HttpMockServer::daemonFlags(const ServerOptions &options)
+{
+    unsigned int flags = MHD_USE_AUTO;
+    if(options.turbo)
+        flags |= MHD_USE_TURBO;
+
+    if(options.tcpFastOpen)
+        flags |= MHD_USE_TCP_FASTOPEN;
+
+    if(options.allowWebSocket)
+        flags |= MHD_ALLOW_UPGRADE;
+
+    return flags;
+}
+
+std::vector<MHD_OptionItem> HttpMockServer::daemonOptions(const ServerOptions &options)
+{
+    std::vector<MHD_OptionItem> optionItems;
+    if(options.connectionLimit > 0)
+        optionItems.push_back({MHD_OPTION_CONNECTION_LIMIT, static_cast<intptr_t>(options.connectionLimit), nullptr});
+
+    if(options.connectionMemoryLimit > 0)
+        optionItems.push_back({MHD_OPTION_CONNECTION_MEMORY_LIMIT, static_cast<intptr_t>(options.connectionMemoryLimit), nullptr});
+
+    if(options.connectionTimeoutSec > 0)
+        optionItems.push_back({MHD_OPTION_CONNECTION_TIMEOUT, static_cast<intptr_t>(options.connectionTimeoutSec), nullptr});
+
+    if(options.listenBacklogSize > 0)
+        optionItems.push_back({MHD_OPTION_LISTEN_BACKLOG_SIZE, static_cast<intptr_t>(options.listenBacklogSize), nullptr});
+
+    if(options.tcpFastOpen && (options.tcpFastOpenQueueSize > 0))
+        optionItems.push_back({MHD_OPTION_TCP_FASTOPEN_QUEUE_SIZE, static_cast<intptr_t>(options.tcpFastOpenQueueSize), nullptr});
+
+    // terminates MHD_OPTION_ARRAY
+    optionItems.push_back({MHD_OPTION_END, 0, nullptr});
+    return optionItems;
+}
+
+void HttpMockServer::runPollingLoop(int cpu)
+{
+#ifdef __linux__
+    if(cpu >= 0)
+    {
+        cpu_set_t cpuSet;
+        CPU_ZERO(&cpuSet);
+        CPU_SET(cpu, &cpuSet);
+        int result = pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet);
+        if(result != 0)
+            std::cerr << "HttpMockServer has failed to pin the polling thread to cpu " << cpu << ": " << strerror(result) << std::endl;
+    }
+#else
+    (void)cpu;
+#endif
+
+    // The timeout limits the latency of stop(), because nothing wakes up MHD_run_wait() from the outside
+    while(m_pollingActive)
+        MHD_run_wait(m_httpServer.get(), 50);
 }
 
 void HttpMockServer::stop()
 {
+    // libmicrohttpd expects that all upgraded connections are closed before the daemon is stopped
+    closeWebSocketSessions();
+
+    m_pollingActive = false;
+    if(m_pollingThread.joinable())
+        m_pollingThread.join();
+
     m_httpServer.reset();
+
+    // no callback is running anymore
+    reclaimConfigurations();
 }
 
 bool HttpMockServer::isRunning()
@@ -103,6 +324,12 @@ void HttpMockServer::staticOnRequestCompleted(void *token, MHD_Connection *conne
         return static_cast<HttpMockServer*>(token)->onRequestCompleted(connection, connectionToken, terminationCode);
 }
 
+void HttpMockServer::staticOnConnectionNotify(void *token, [[maybe_unused]] MHD_Connection *connection, void **socketToken, MHD_ConnectionNotificationCode notificationCode)
+{
+    if(token != nullptr)
+        static_cast<HttpMockServer*>(token)->onConnectionNotify(socketToken, notificationCode);
+}
+
 MHD_Result HttpMockServer::staticOnKeyValueIterator(void *token, [[maybe_unused]] MHD_ValueKind kind, const char *key, const char *value)
 {
 
@@ -115,6 +342,14 @@ MHD_Result HttpMockServer::staticOnKeyValueIterator(void *token, [[maybe_unused]
     return MHD_YES;
 }
 
+void HttpMockServer::staticOnUpgrade(void *token, [[maybe_unused]] MHD_Connection *connection, void *connectionToken, const char *extraIn, size_t extraInSize, MHD_socket socket, MHD_UpgradeResponseHandle *upgradeHandle)
+{
+    if(token != nullptr)
+        static_cast<HttpMockServer*>(token)->onUpgrade(static_cast<ConnectionData*>(connectionToken), extraIn, extraInSize, socket, upgradeHandle);
+    else
+        MHD_upgrade_action(upgradeHandle, MHD_UPGRADE_ACTION_CLOSE);
+}
+
 MHD_Result HttpMockServer::onConnectionCallback(MHD_Connection *connection, const char *url, const char *method, const char *version, const char *uploadData, size_t *uploadDataSize, void **connectionToken)
 {
     m_callbackRunning = true;
@@ -129,8 +364,30 @@ MHD_Result HttpMockServer::onConnectionCallback(MHD_Connection *connection, cons
         }
 
         // first time we arrive here
-        std::unique_ptr<ConnectionData> connectionData = std::make_unique<ConnectionData>();
+        std::unique_ptr<ConnectionData> connectionData;
+        {
+            std::lock_guard<std::mutex> lock(m_connectionsMutex);
+            if(!m_connectionDataPool.empty())
+            {
+                connectionData = std::move(m_connectionDataPool.back());
+                m_connectionDataPool.pop_back();
+            }
+        }
+
+        // pooled objects have been cleared when they were returned to the pool
+        if(!connectionData)
+        {
+            connectionData = std::make_unique<ConnectionData>();
+            connectionData->clear();
+        }
 
+        connectionData->phases.firstCallback = std::chrono::steady_clock::now();
+        connectionData->requestId = m_nextRequestId++;
+        if(TcpConnection *tcp = tcpConnection(connection))
+        {
+            connectionData->connectionId = tcp->connectionId;
+            connectionData->requestIndexOnConnection = tcp->requestCount++;
+        }
         connectionData->mockServer = this;
         connectionData->connection = connection;
         connectionData->responseCode = MHD_HTTP_OK;
@@ -143,7 +400,7 @@ MHD_Result HttpMockServer::onConnectionCallback(MHD_Connection *connection, cons
 
         if(strcmp(method, "POST") == 0)
         {
-            connectionData->postProcessor = MHD_create_post_processor(connection, 65536, staticOnIteratePostCallback, static_cast<void *>(connectionData.get()));
+            connectionData->postProcessor = MHD_create_post_processor(connection, m_options.postProcessorBufferSize, staticOnIteratePostCallback, static_cast<void *>(connectionData.get()));
             if(connectionData->postProcessor == nullptr)
                 connectionData->httpMethod = HttpMethod::PostRawData;
             else
@@ -153,6 +410,8 @@ MHD_Result HttpMockServer::onConnectionCallback(MHD_Connection *connection, cons
             connectionData->httpMethod = HttpMethod::Get;
 
         *connectionToken = static_cast<void *>(connectionData.get());
+
+        std::lock_guard<std::mutex> lock(m_connectionsMutex);
         m_runningConnections.push_back(std::move(connectionData));
         return MHD_YES;
     }
@@ -179,6 +438,9 @@ MHD_Result HttpMockServer::onConnectionCallback(MHD_Connection *connection, cons
             else
                 MHD_post_process(connectionData->postProcessor, uploadData, *uploadDataSize);
 
+            if(TcpConnection *tcp = tcpConnection(connection))
+                tcp->receivedBytes.fetch_add(*uploadDataSize, std::memory_order_relaxed);
+
             *uploadDataSize = 0;
             return MHD_YES;
         }
@@ -265,6 +527,12 @@ void HttpMockServer::onRequestCompleted([[maybe_unused]] MHD_Connection *connect
         MHD_destroy_post_processor(connectionData->postProcessor);
     }
 
+    connectionData->phases.requestCompleted = std::chrono::steady_clock::now();
+    if(m_tracer)
+        m_tracer->record(*connectionData);
+
+    std::unique_ptr<ConnectionData> previousConnection;
+    std::unique_lock<std::mutex> connectionsLock(m_connectionsMutex);
     auto savedConnectionData = std::find_if(m_runningConnections.begin(), m_runningConnections.end(), [connectionData](const std::unique_ptr<ConnectionData> &entry)
     {
         return connectionData == entry.get();
@@ -272,10 +540,25 @@ void HttpMockServer::onRequestCompleted([[maybe_unused]] MHD_Connection *connect
 
     if(savedConnectionData != m_runningConnections.end())
     {
+        previousConnection = std::move(m_lastConnection);
         m_lastConnection = std::move(*savedConnectionData);
         m_runningConnections.erase(savedConnectionData);
         *connectionToken = nullptr;
     }
+    connectionsLock.unlock();
+
+    // The previous request enters the pool cleared, so that its request data and responseBodyOwner are released now
+    // and not only when the object is reused. Clearing may unmap a body, so it is done outside of the lock.
+    if(previousConnection)
+    {
+        previousConnection->clear();
+        connectionsLock.lock();
+        m_connectionDataPool.push_back(std::move(previousConnection));
+        connectionsLock.unlock();
+    }
+
+    m_lastCompletedTime = std::chrono::steady_clock::now().time_since_epoch().count();
+    m_completedRequests++;
 
     {
         std::lock_guard<std::mutex> lock(m_requestCompletedMutex);
@@ -284,42 +567,430 @@ void HttpMockServer::onRequestCompleted([[maybe_unused]] MHD_Connection *connect
     m_requestCompletedConditionVariable.notify_one();
 }
 
+void HttpMockServer::onConnectionNotify(void **socketToken, MHD_ConnectionNotificationCode notificationCode)
+{
+    if(notificationCode == MHD_CONNECTION_NOTIFY_STARTED)
+    {
+        std::unique_ptr<TcpConnection> tcp = std::make_unique<TcpConnection>();
+        tcp->connectionId = m_nextConnectionId++;
+        *socketToken = tcp.get();
+
+        std::lock_guard<std::mutex> lock(m_tcpConnectionsMutex);
+        m_openTcpConnections.emplace(tcp->connectionId, std::move(tcp));
+    }
+    else if((notificationCode == MHD_CONNECTION_NOTIFY_CLOSED) && (*socketToken != nullptr))
+    {
+        TcpConnection *tcp = static_cast<TcpConnection *>(*socketToken);
+        *socketToken = nullptr;
+
+        std::lock_guard<std::mutex> lock(m_tcpConnectionsMutex);
+        m_closedTcpConnections.push_back(tcp->record(false));
+        m_openTcpConnections.erase(tcp->connectionId);
+    }
+}
+
+HttpMockServer::TcpConnection *HttpMockServer::tcpConnection(MHD_Connection *connection)
+{
+    const union MHD_ConnectionInfo *info = MHD_get_connection_info(connection, MHD_CONNECTION_INFO_SOCKET_CONTEXT);
+    return info ? static_cast<TcpConnection *>(info->socket_context) : nullptr;
+}
+
+ConnectionRecord HttpMockServer::TcpConnection::record(bool open) const
+{
+    ConnectionRecord record;
+    record.connectionId = connectionId;
+    record.requestCount = requestCount.load(std::memory_order_relaxed);
+    record.receivedBytes = receivedBytes.load(std::memory_order_relaxed);
+    record.sentBytes = sentBytes.load(std::memory_order_relaxed);
+    record.open = open;
+    return record;
+}
+
+ConnectionStatistics HttpMockServer::connectionStatistics() const
+{
+    ConnectionStatistics statistics;
+    for(auto &record : connectionRecords())
+    {
+        statistics.connections++;
+        if(record.open)
+            statistics.openConnections++;
+
+        statistics.requests += record.requestCount;
+        if(record.requestCount > 0)
+            statistics.reusedRequests += record.requestCount - 1;
+        statistics.maxRequestsPerConnection = std::max(statistics.maxRequestsPerConnection, record.requestCount);
+    }
+
+    return statistics;
+}
+
+std::vector<ConnectionRecord> HttpMockServer::connectionRecords() const
+{
+    std::lock_guard<std::mutex> lock(m_tcpConnectionsMutex);
+
+    std::vector<ConnectionRecord> records = m_closedTcpConnections;
+    for(auto &entry : m_openTcpConnections)
+        records.push_back(entry.second->record(true));
+
+    return records;
+}
+
 MHD_Result HttpMockServer::generateResponse(ConnectionData *connectionData)
 {
+    connectionData->phases.uploadCompleted = std::chrono::steady_clock::now();
+
     MHD_get_connection_values(connectionData->connection, MHD_GET_ARGUMENT_KIND, &staticOnKeyValueIterator, &connectionData->urlArguments);
     MHD_get_connection_values(connectionData->connection, MHD_HEADER_KIND,       &staticOnKeyValueIterator, &connectionData->header);
 
-    if(m_generateResponseCallback)
-        m_generateResponseCallback(connectionData);
+    if(m_options.allowWebSocket)
+    {
+        const char *upgrade = MHD_lookup_connection_value(connectionData->connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_UPGRADE);
+        if(upgrade && (strcasecmp(upgrade, "websocket") == 0))
+            return generateWebSocketUpgradeResponse(connectionData);
+    }
+
+    // The request sticks to this configuration, even if a new one is published meanwhile
+    const size_t readerSlot = enterConfiguration();
+    CU_SCOPE_EXIT{leaveConfiguration(readerSlot);};
+    const ResponseConfiguration &configuration = *m_configuration.load();
+
+    if(configuration.bodyTemplate)
+        configuration.bodyTemplate->render(*connectionData, connectionData->responseBody);
+
+    const auto &headerTemplates = configuration.headerTemplates;
+    connectionData->responseHeaderTemplateValues.resize(headerTemplates.size());
+    for(size_t i=0; i<headerTemplates.size(); ++i)
+    {
+        std::string &value = connectionData->responseHeaderTemplateValues[i];
+        headerTemplates[i].second.render(*connectionData, value);
+        // request data like {{arg.x}} may contain line breaks, which libmicrohttpd refuses in a header
+        value.erase(std::remove_if(value.begin(), value.end(), [](char c) { return (c == '\r') || (c == '\n'); }), value.end());
+    }
+
+    connectionData->phases.callbackEntered = std::chrono::steady_clock::now();
+    if(configuration.generateResponseCallback)
+        configuration.generateResponseCallback(connectionData);
+    connectionData->phases.callbackExited = std::chrono::steady_clock::now();
 
     struct MHD_Response *response;
-    if(connectionData->responseBody.size() > 0)
+    if(connectionData->responseBodyView.size() > 0)
+        response = MHD_create_response_from_buffer(connectionData->responseBodyView.size(), const_cast<char *>(connectionData->responseBodyView.data()), MHD_RESPMEM_PERSISTENT);
+    else if(connectionData->responseBody.size() > 0)
         response = MHD_create_response_from_buffer(connectionData->responseBody.size(), const_cast<char *>(connectionData->responseBody.c_str()), MHD_RESPMEM_PERSISTENT);
     else
         response = MHD_create_response_from_buffer(0, NULL, MHD_RESPMEM_PERSISTENT);
     if(!response)
         return MHD_NO;
 
+    for(size_t i=0; i<headerTemplates.size(); ++i)
+    {
+        if(containsHeader(connectionData->responseHeader, headerTemplates[i].first))
+            continue;
+
+        enum MHD_Result returnCode = MHD_add_response_header(response, headerTemplates[i].first.c_str(), connectionData->responseHeaderTemplateValues[i].c_str());
+        if(returnCode == MHD_NO)
+        {
+            MHD_destroy_response(response);
+            return MHD_NO;
+        }
+    }
+
     for(auto &entry : connectionData->responseHeader)
     {
         enum MHD_Result returnCode = MHD_add_response_header(response, entry.first.c_str(), entry.second.c_str());
         if(returnCode == MHD_NO)
+        {
+            MHD_destroy_response(response);
             return MHD_NO;
+        }
     }
 
     enum MHD_Result returnCode = MHD_queue_response(connectionData->connection, connectionData->responseCode, response);
+    connectionData->phases.responseQueued = std::chrono::steady_clock::now();
+
+    // a response, which libmicrohttpd hasn't accepted, is never sent
+    TcpConnection *tcp = (returnCode == MHD_YES) ? tcpConnection(connectionData->connection) : nullptr;
+    if(tcp)
+        tcp->sentBytes.fetch_add(connectionData->responseBodyView.empty() ? connectionData->responseBody.size() : connectionData->responseBodyView.size(), std::memory_order_relaxed);
+
     MHD_destroy_response(response);
     return returnCode;
 }
 
+MHD_Result HttpMockServer::generateWebSocketUpgradeResponse(ConnectionData *connectionData)
+{
+    const char *clientKey = MHD_lookup_connection_value(connectionData->connection, MHD_HEADER_KIND, "Sec-WebSocket-Key");
+    if(clientKey == nullptr)
+    {
+        connectionData->responseCode = MHD_HTTP_BAD_REQUEST;
+
+        struct MHD_Response *response = MHD_create_response_from_buffer(0, NULL, MHD_RESPMEM_PERSISTENT);
+        if(!response)
+            return MHD_NO;
+
+        enum MHD_Result returnCode = MHD_queue_response(connectionData->connection, MHD_HTTP_BAD_REQUEST, response);
+        MHD_destroy_response(response);
+        return returnCode;
+    }
+
+    connectionData->responseCode = MHD_HTTP_SWITCHING_PROTOCOLS;
+    connectionData->responseHeader[MHD_HTTP_HEADER_UPGRADE] = "websocket";
+    connectionData->responseHeader["Sec-WebSocket-Accept"] = WebSocketSession::acceptKey(clientKey);
+
+    struct MHD_Response *response = MHD_create_response_for_upgrade(&staticOnUpgrade, this);
+    if(!response)
+        return MHD_NO;
+
+    for(auto &entry : connectionData->responseHeader)
+    {
+        enum MHD_Result returnCode = MHD_add_response_header(response, entry.first.c_str(), entry.second.c_str());
+        if(returnCode == MHD_NO)
+        {
+            MHD_destroy_response(response);
+            return MHD_NO;
+        }
+    }
+
+    enum MHD_Result returnCode = MHD_queue_response(connectionData->connection, MHD_HTTP_SWITCHING_PROTOCOLS, response);
+    connectionData->phases.responseQueued = std::chrono::steady_clock::now();
+    MHD_destroy_response(response);
+    return returnCode;
+}
+
+void HttpMockServer::onUpgrade(ConnectionData *connectionData, const char *extraIn, size_t extraInSize, MHD_socket socket, MHD_UpgradeResponseHandle *upgradeHandle)
+{
+    std::shared_ptr<WebSocketSession> session = std::make_shared<WebSocketSession>(connectionData ? connectionData->url : std::string(), socket, upgradeHandle,
+        [this](WebSocketSession &session, WebSocketOpcode opcode, const std::byte *data, size_t size)
+    {
+        dispatchWebSocketMessage(session, opcode, data, size);
+    }, m_options.webSocketSendTimeoutMs);
+
+    // Nothing is released on the polling thread: a finished session removes itself on its own read thread
+    session->m_onFinished = [this](WebSocketSession &session)
+    {
+        removeWebSocketSession(session);
+    };
+
+    // started under the mutex, so that it can't remove itself before it is registered
+    {
+        std::lock_guard<std::mutex> lock(m_webSocketMutex);
+        session->start(extraIn, extraInSize);
+        m_webSocketSessions.push_back(std::move(session));
+    }
+    m_webSocketConditionVariable.notify_all();
+}
+
+void HttpMockServer::dispatchWebSocketMessage(WebSocketSession &session, WebSocketOpcode opcode, const std::byte *data, size_t size)
+{
+    const size_t readerSlot = enterConfiguration();
+    CU_SCOPE_EXIT{leaveConfiguration(readerSlot);};
+    const ResponseConfiguration &configuration = *m_configuration.load();
+
+    if(configuration.onWebSocketMessage)
+        configuration.onWebSocketMessage(session, opcode, data, size);
+}
+
+void HttpMockServer::removeWebSocketSession(WebSocketSession &session)
+{
+    // the read thread still holds a reference, so the session isn't destroyed under the mutex
+    std::lock_guard<std::mutex> lock(m_webSocketMutex);
+    auto entry = std::find_if(m_webSocketSessions.begin(), m_webSocketSessions.end(), [&session](const std::shared_ptr<WebSocketSession> &candidate)
+    {
+        return candidate.get() == &session;
+    });
+
+    if(entry != m_webSocketSessions.end())
+        m_webSocketSessions.erase(entry);
+}
+
+void HttpMockServer::closeWebSocketSessions()
+{
+    std::vector<std::shared_ptr<WebSocketSession>> sessions;
+    {
+        std::lock_guard<std::mutex> lock(m_webSocketMutex);
+        sessions.swap(m_webSocketSessions);
+    }
+
+    // a test may still hold a reference, so we can't rely on the destructor
+    for(auto &session : sessions)
+        session->terminate();
+}
+
+void HttpMockServer::setWebSocketMessageCallback(const webSocketMessageCallback &newWebSocketMessageCallback)
+{
+    publishConfiguration([&](ResponseConfiguration &configuration)
+    {
+        configuration.onWebSocketMessage = newWebSocketMessageCallback;
+    });
+}
+
+bool HttpMockServer::waitForWebSocketSessions(size_t count, uint32_t timeoutMs)
+{
+    auto enoughOpenSessions = [this, count]
+    {
+        return static_cast<size_t>(std::count_if(m_webSocketSessions.begin(), m_webSocketSessions.end(), [](const std::shared_ptr<WebSocketSession> &session)
+        {
+            return session->isOpen();
+        })) >= count;
+    };
+
+    std::unique_lock<std::mutex> lock(m_webSocketMutex);
+    if(timeoutMs == 0)
+    {
+        m_webSocketConditionVariable.wait(lock, enoughOpenSessions);
+        return true;
+    }
+
+    return m_webSocketConditionVariable.wait_for(lock, std::chrono::milliseconds(timeoutMs), enoughOpenSessions);
+}
+
+std::vector<std::shared_ptr<WebSocketSession>> HttpMockServer::webSocketSessions()
+{
+    // Only copies: this may be called by a message callback, which must never release a session on its read thread
+    std::vector<std::shared_ptr<WebSocketSession>> sessions;
+    std::lock_guard<std::mutex> lock(m_webSocketMutex);
+    std::copy_if(m_webSocketSessions.begin(), m_webSocketSessions.end(), std::back_inserter(sessions), [](const std::shared_ptr<WebSocketSession> &session)
+    {
+        return session->isOpen();
+    });
+
+    return sessions;
+}
+
+size_t HttpMockServer::broadcast(const WebSocketFrame &frame, size_t count)
+{
+    size_t reached = 0;
+    for(auto &session : webSocketSessions())
+    {
+        if(session->send(frame, count))
+            reached++;
+    }
+
+    return reached;
+}
+
+void HttpMockServer::writeChromeTrace(std::ostream &output) const
+{
+    if(m_tracer)
+        m_tracer->writeChromeTrace(output);
+    else
+        output << "{\"traceEvents\":[]}\n";
+}
+
+void HttpMockServer::writeTraceEvents(std::ostream &output, bool &first, int processId) const
+{
+    if(m_tracer)
+        m_tracer->writeTraceEvents(output, first, processId);
+}
+
 int HttpMockServer::port() const
 {
-    return m_port;
+    return m_httpServer ? m_boundPort : m_port;
+}
+
+uint64_t HttpMockServer::completedRequestCount() const
+{
+    return m_completedRequests;
+}
+
+std::chrono::steady_clock::time_point HttpMockServer::lastCompletedTime() const
+{
+    return std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(m_lastCompletedTime.load()));
 }
 
 void HttpMockServer::setGenerateResponseCallback(const callbackFunction &newGenerateResponseCallback)
 {
-    m_generateResponseCallback = newGenerateResponseCallback;
+    publishConfiguration([&](ResponseConfiguration &configuration)
+    {
+        configuration.generateResponseCallback = newGenerateResponseCallback;
+    });
+}
+
+void HttpMockServer::setResponseTemplate(const std::string &bodyTemplate, const std::vector<std::pair<std::string, std::string>> &headerTemplates)
+{
+    // parse everything first, so that a failing template leaves the previous configuration untouched
+    std::shared_ptr<const ResponseTemplate> newBodyTemplate = std::make_shared<ResponseTemplate>(bodyTemplate);
+
+    std::vector<std::pair<std::string, ResponseTemplate>> newHeaderTemplates;
+    for(auto &entry : headerTemplates)
+        newHeaderTemplates.emplace_back(entry.first, ResponseTemplate(entry.second));
+
+    publishConfiguration([&](ResponseConfiguration &configuration)
+    {
+        configuration.bodyTemplate = std::move(newBodyTemplate);
+        configuration.headerTemplates = std::move(newHeaderTemplates);
+    });
+}
+
+void HttpMockServer::clearResponseTemplate()
+{
+    publishConfiguration([](ResponseConfiguration &configuration)
+    {
+        configuration.bodyTemplate.reset();
+        configuration.headerTemplates.clear();
+    });
+}
+
+size_t HttpMockServer::enterConfiguration()
+{
+    // a thread keeps its counter, so that it leaves the same counter it has entered
+    static std::atomic<size_t> nextReaderSlot{0};
+    thread_local const size_t readerSlot = nextReaderSlot++ % configurationReaderSlots;
+
+    m_configurationReaders[readerSlot].readers++;
+    return readerSlot;
+}
+
+void HttpMockServer::leaveConfiguration(size_t readerSlot)
+{
+    // try_lock: a reader never waits for a writer. If the lock is taken, the writer or a later reader does the check.
+    if((m_configurationReaders[readerSlot].readers-- == 1) && m_hasRetiredConfigurations)
+    {
+        std::unique_lock<std::mutex> lock(m_configurationMutex, std::try_to_lock);
+        if(lock.owns_lock())
+            deleteRetiredConfigurations();
+    }
+}
+
+void HttpMockServer::publishConfiguration(const std::function<void (ResponseConfiguration &configuration)> &modify)
+{
+    std::lock_guard<std::mutex> lock(m_configurationMutex);
+
+    std::unique_ptr<ResponseConfiguration> newConfiguration = std::make_unique<ResponseConfiguration>(*m_currentConfiguration);
+    modify(*newConfiguration);
+
+    // From here on, new requests see the new configuration ...
+    m_configuration = newConfiguration.get();
+    m_retiredConfigurations.push_back({std::move(m_currentConfiguration), std::bitset<configurationReaderSlots>().set()});
+    m_currentConfiguration = std::move(newConfiguration);
+    m_hasRetiredConfigurations = true;
+
+    // ... and a reader, which isn't counted at this point, can only load the new one (all accesses are sequentially consistent)
+    deleteRetiredConfigurations();
+}
+
+void HttpMockServer::reclaimConfigurations()
+{
+    std::lock_guard<std::mutex> lock(m_configurationMutex);
+    deleteRetiredConfigurations();
+}
+
+void HttpMockServer::deleteRetiredConfigurations()
+{
+    std::bitset<configurationReaderSlots> busySlots;
+    for(size_t i=0; i<configurationReaderSlots; ++i)
+        busySlots[i] = (m_configurationReaders[i].readers != 0);
+
+    // A counter at zero now has no reader left, which might still use a configuration retired before this point
+    for(auto &retired : m_retiredConfigurations)
+        retired.busySlots &= busySlots;
+
+    m_retiredConfigurations.erase(std::remove_if(m_retiredConfigurations.begin(), m_retiredConfigurations.end(), [](const RetiredConfiguration &retired)
+    {
+        return retired.busySlots.none();
+    }), m_retiredConfigurations.end());
+
+    m_hasRetiredConfigurations = !m_retiredConfigurations.empty();
 }
 
 }
@@ -6,9 +6,18 @@
 #include <functional>
 #include <condition_variable>
 #include <atomic>
+#include <array>
+#include <bitset>
+#include <thread>
+#include <chrono>
+#include <string_view>
 
 #include <microhttpd.h>
 
+#include "httpmockserver/responsetemplate.hpp"
+#include "httpmockserver/websocket.hpp"
+#include "httpmockserver/requesttracer.hpp"
+
 namespace httpmock
 {
 
@@ -21,6 +30,9 @@ enum class HttpMethod
 };
 
 class HttpMockServer;
+
+// Despite its name, ConnectionData describes one HTTP request. With keep-alive, several requests share one TCP connection,
+// which is described by a ConnectionRecord.
 class ConnectionData
 {
 public:
@@ -28,6 +40,12 @@ public:
     MHD_Connection *connection;
     MHD_PostProcessor *postProcessor;
 
+    // TCP connection of the request: unique id within the server and the index of the request on that connection (0: first request).
+    // libmicrohttpd handles the requests of a connection strictly one after another, also if the client pipelines them:
+    // a pipelined request gets the next index, its callbacks never overlap with the previous request.
+    uint64_t connectionId;
+    uint64_t requestIndexOnConnection;
+
     // request data
     std::string url;
     std::string version;
@@ -51,50 +69,229 @@ public:
     std::unordered_map<std::string, std::string> responseHeader;
     std::string responseBody;
     int responseCode;
+
+    // Alternative to responseBody, which isn't copied (e.g. a canned or memory mapped body): if not empty, it is sent instead of responseBody.
+    // The memory must stay valid until the request is completed; responseBodyOwner can keep it alive until then.
+    std::string_view responseBodyView;
+    std::shared_ptr<const void> responseBodyOwner;
+
+    // rendered values of the header templates (see HttpMockServer::setResponseTemplate), in the order of registration
+    std::vector<std::string> responseHeaderTemplateValues;
+
+    // diagnostics
+    uint64_t requestId;
+    RequestPhases phases;
+
+    // resets all fields, but keeps the capacity of the buffers up to 64 KiB each, so that a recycled object doesn't allocate
+    void clear();
 };
 
 using callbackFunction = std::function<void (ConnectionData *connectionData)>;
 
+// One TCP connection (MHD_OPTION_NOTIFY_CONNECTION)
+struct ConnectionRecord
+{
+    uint64_t connectionId{0};
+    uint64_t requestCount{0};
+    uint64_t receivedBytes{0}; // request bodies
+    uint64_t sentBytes{0};     // response bodies queued successfully
+    bool open{false};
+};
+
+// Aggregated keep-alive reuse since start()
+struct ConnectionStatistics
+{
+    uint64_t connections{0};     // accepted TCP connections
+    uint64_t openConnections{0};
+    uint64_t requests{0};        // requests on these connections
+    uint64_t reusedRequests{0};  // requests after the first one of their connection
+    uint64_t maxRequestsPerConnection{0};
+
+    double requestsPerConnection() const;
+    // share of the requests, which reused an already used connection: 0 without keep-alive, close to 1 with a perfect pool.
+    // Idle connections without a request don't count.
+    double reuseRatio() const;
+};
+
+// Resource limits and tuning of the libmicrohttpd daemon. A value of 0 keeps the libmicrohttpd default.
+struct ServerOptions
+{
+    unsigned connectionLimit{0};            // MHD_OPTION_CONNECTION_LIMIT; for the whole server, also if sharded
+    size_t connectionMemoryLimit{0};        // MHD_OPTION_CONNECTION_MEMORY_LIMIT in bytes per connection
+    unsigned connectionTimeoutSec{0};       // MHD_OPTION_CONNECTION_TIMEOUT; 0: no timeout
+    unsigned listenBacklogSize{0};          // MHD_OPTION_LISTEN_BACKLOG_SIZE
+    bool turbo{false};                      // MHD_USE_TURBO
+    bool tcpFastOpen{false};                // MHD_USE_TCP_FASTOPEN
+    unsigned tcpFastOpenQueueSize{0};       // MHD_OPTION_TCP_FASTOPEN_QUEUE_SIZE; only used with tcpFastOpen
+    size_t postProcessorBufferSize{65536};  // buffer size of MHD_create_post_processor; libmicrohttpd requires at least 256
+    unsigned threadPoolSize{0};             // MHD_OPTION_THREAD_POOL_SIZE; 0: a single internal polling thread
+    bool allowWebSocket{false};             // MHD_ALLOW_UPGRADE: requests with "Upgrade: websocket" become WebSocket sessions
+    unsigned webSocketSendTimeoutMs{1000};  // a WebSocket peer, which doesn't read for this time, is disconnected; 0: no timeout
+    size_t traceBufferSize{0};              // requests per polling thread, which are recorded for writeChromeTrace(); 0: tracing disabled
+};
+
 class HttpMockServer
 {
 public:
     explicit HttpMockServer(int port = 8080);
     ~HttpMockServer();
-    void start();
+    // throws std::runtime_error, if the daemon can't be started, and std::invalid_argument for invalid options
+    void start(const ServerOptions &options = {});
     void stop();
     bool isRunning();
 
     bool waitForRequestCompleted(uint32_t count = 1, uint32_t timeoutMs = 0);
     ConnectionData *lastConnectionData();
     void setGenerateResponseCallback(const callbackFunction &newGenerateResponseCallback);
+    // The templates are rendered before the generate response callback is called, so the callback can still modify the response.
+    // A header in ConnectionData::responseHeader replaces the header template of the same name.
+    // throws std::invalid_argument, if a template can't be parsed
+    void setResponseTemplate(const std::string &bodyTemplate, const std::vector<std::pair<std::string, std::string>> &headerTemplates = {});
+    // removes the body and header templates
+    void clearResponseTemplate();
+
+    // WebSocket (requires ServerOptions::allowWebSocket). The callback is called from the read thread of the session.
+    void setWebSocketMessageCallback(const webSocketMessageCallback &newWebSocketMessageCallback);
+    // only open sessions are counted and returned; a closed session is dropped, once its read thread has finished
+    bool waitForWebSocketSessions(size_t count = 1, uint32_t timeoutMs = 0);
+    std::vector<std::shared_ptr<WebSocketSession>> webSocketSessions();
+    // sends the frame count times to every open session; returns the number of sessions reached
+    size_t broadcast(const WebSocketFrame &frame, size_t count = 1);
 
+    // Chrome trace event JSON of the recorded request phases (requires ServerOptions::traceBufferSize)
+    void writeChromeTrace(std::ostream &output) const;
+
+    // keep-alive accounting, e.g. to check the connection pool of a client
+    ConnectionStatistics connectionStatistics() const;
+    std::vector<ConnectionRecord> connectionRecords() const;
+
+    // the bound port while running, also if the server has been created with port 0; else the requested port
     int port() const;
+    uint64_t completedRequestCount() const;
+    std::chrono::steady_clock::time_point lastCompletedTime() const;
 
 private:
+    friend class ShardedHttpMockServer;
+
+    // Used by ShardedHttpMockServer: the daemon takes over an already bound listen socket and is polled by an own thread pinned to the given cpu (-1: no pinning).
+    void startOnListenSocket(int listenSocket, int cpu, const ServerOptions &options);
+    void runPollingLoop(int cpu);
+    void createTracer();
+    void writeTraceEvents(std::ostream &output, bool &first, int processId) const;
+
     // C-Callbacks from libmicrohttpd library
     static enum MHD_Result staticOnConnectionCallback(void *token, struct MHD_Connection *connection, const char *url, const char *method, const char *version, const char *uploadData, size_t *uploadDataSize, void **connectionToken);
     static enum MHD_Result staticOnIteratePostCallback(void *token, enum MHD_ValueKind kind, const char *key, const char *filename, const char *contentType, const char *transferEncoding, const char *data, uint64_t offset, size_t size);
     static void staticOnRequestCompleted(void *token, struct MHD_Connection *connection, void **connectionToken, enum MHD_RequestTerminationCode terminationCode);   
+    static void staticOnConnectionNotify(void *token, struct MHD_Connection *connection, void **socketToken, enum MHD_ConnectionNotificationCode notificationCode);
     static enum MHD_Result staticOnKeyValueIterator(void *token, enum MHD_ValueKind kind, const char *key, const char *value);
+    static void staticOnUpgrade(void *token, struct MHD_Connection *connection, void *connectionToken, const char *extraIn, size_t extraInSize, MHD_socket socket, struct MHD_UpgradeResponseHandle *upgradeHandle);
 
     enum MHD_Result onConnectionCallback(struct MHD_Connection *connection, const char *url, const char *method, const char *version, const char *uploadData, size_t *uploadDataSize, void **connectionToken);
     enum MHD_Result onIteratePostCallback(ConnectionData* connectionData, enum MHD_ValueKind kind, const char *key, const char *filename, const char *contentType, const char *transferEncoding, const char *data, uint64_t offset, size_t size);
     void onRequestCompleted(struct MHD_Connection *connection, void **connectionToken, enum MHD_RequestTerminationCode terminationCode);
+    void onConnectionNotify(void **socketToken, enum MHD_ConnectionNotificationCode notificationCode);
+
+    void onUpgrade(ConnectionData *connectionData, const char *extraIn, size_t extraInSize, MHD_socket socket, struct MHD_UpgradeResponseHandle *upgradeHandle);
 
     MHD_Result generateResponse(ConnectionData *connectionData);
+    MHD_Result generateWebSocketUpgradeResponse(ConnectionData *connectionData);
+    void dispatchWebSocketMessage(WebSocketSession &session, WebSocketOpcode opcode, const std::byte *data, size_t size);
+    // called by the read thread of a finished session
+    void removeWebSocketSession(WebSocketSession &session);
+    void closeWebSocketSessions();
+
+    static void validateOptions(const ServerOptions &options);
+    static unsigned int daemonFlags(const ServerOptions &options);
+    static std::vector<MHD_OptionItem> daemonOptions(const ServerOptions &options);
 
     std::unique_ptr<MHD_Daemon, void(*)(MHD_Daemon*)> m_httpServer;
+    ServerOptions m_options;
+    std::unique_ptr<RequestTracer> m_tracer;
+
+    // TCP connections; the counters are written by the polling thread of the connection and read by the test
+    struct TcpConnection
+    {
+        uint64_t connectionId;
+        std::atomic<uint64_t> requestCount{0};
+        std::atomic<uint64_t> receivedBytes{0};
+        std::atomic<uint64_t> sentBytes{0};
+
+        ConnectionRecord record(bool open) const;
+    };
+
+    static TcpConnection *tcpConnection(struct MHD_Connection *connection);
+    void resetConnectionStatistics();
+
+    mutable std::mutex m_tcpConnectionsMutex;
+    std::unordered_map<uint64_t, std::unique_ptr<TcpConnection>> m_openTcpConnections;
+    std::vector<ConnectionRecord> m_closedTcpConnections;
+    std::atomic<uint64_t> m_nextConnectionId{1};
+
+    // In thread pool mode the callbacks are called from several threads
+    std::mutex m_connectionsMutex;
     std::vector<std::unique_ptr<ConnectionData>> m_runningConnections;
     std::unique_ptr<ConnectionData> m_lastConnection;
+    std::vector<std::unique_ptr<ConnectionData>> m_connectionDataPool;
+
+    // Everything, which generates a response. The configuration is immutable once published and is replaced as a whole (RCU):
+    // generateResponse() reads it without a lock, and an old configuration is deleted only when no reader is active anymore.
+    struct ResponseConfiguration
+    {
+        callbackFunction generateResponseCallback;
+        std::shared_ptr<const ResponseTemplate> bodyTemplate;
+        std::vector<std::pair<std::string, ResponseTemplate>> headerTemplates;
+        webSocketMessageCallback onWebSocketMessage;
+    };
+
+    // Every thread counts itself as reader in one of several counters, so that the polling threads don't share one cache line.
+    // A retired configuration is deleted, when each counter has been seen at zero once after the retirement (grace period);
+    // all counters need not be zero at the same time. Readers leaving with their counter at zero check this as well, so the
+    // retired configurations (and e.g. their memory mapped bodies) don't pile up, while the server is never idle.
+    static constexpr size_t configurationReaderSlots = 16;
+    struct alignas(64) ConfigurationReaderSlot
+    {
+        std::atomic<unsigned> readers{0};
+    };
+
+    struct RetiredConfiguration
+    {
+        std::unique_ptr<const ResponseConfiguration> configuration;
+        std::bitset<configurationReaderSlots> busySlots; // not yet seen at zero since the retirement
+    };
 
-    callbackFunction m_generateResponseCallback;
+    size_t enterConfiguration();
+    void leaveConfiguration(size_t readerSlot);
+    void publishConfiguration(const std::function<void (ResponseConfiguration &configuration)> &modify);
+    void reclaimConfigurations();
+    // requires m_configurationMutex
+    void deleteRetiredConfigurations();
+
+    std::atomic<const ResponseConfiguration *> m_configuration;
+    std::array<ConfigurationReaderSlot, configurationReaderSlots> m_configurationReaders;
+    std::atomic<bool> m_hasRetiredConfigurations{false};
+    std::mutex m_configurationMutex; // serializes the writers and the deletion of retired configurations
+    std::unique_ptr<const ResponseConfiguration> m_currentConfiguration;
+    std::vector<RetiredConfiguration> m_retiredConfigurations;
 
     // See for details: https://www.modernescpp.com/index.php/c-core-guidelines-be-aware-of-the-traps-of-condition-variables
     bool m_requestCompletedPredicate{false};
     std::mutex m_requestCompletedMutex;
     std::condition_variable m_requestCompletedConditionVariable;
-    int m_port;
+    int m_port; // requested
+    int m_boundPort{0};
     std::atomic<bool> m_callbackRunning{false};
+
+    std::atomic<uint64_t> m_nextRequestId{1};
+    std::atomic<uint64_t> m_completedRequests{0};
+    std::atomic<std::chrono::steady_clock::rep> m_lastCompletedTime{0};
+
+    std::mutex m_webSocketMutex;
+    std::condition_variable m_webSocketConditionVariable;
+    std::vector<std::shared_ptr<WebSocketSession>> m_webSocketSessions;
+
+    std::thread m_pollingThread;
+    std::atomic<bool> m_pollingActive{false};
 };
 
 }
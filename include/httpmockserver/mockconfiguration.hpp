@@ -0,0 +1,91 @@
+#pragma once
+
+#include "httpmockserver/httpmockserver.hpp"
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+
+namespace httpmock
+{
+
+// Read-only memory mapping of a response body file
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::string &fileName);
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile &operator=(const MappedFile&) = delete;
+
+    std::string_view data() const;
+
+private:
+    void *m_address{nullptr};
+    size_t m_size{0};
+};
+
+struct MockRoute
+{
+    enum class Method
+    {
+        Any,
+        Get,
+        Post
+    };
+
+    Method method{Method::Any};
+    int responseCode{200};
+    std::vector<std::pair<std::string, std::string>> header;
+
+    // exactly one of them is used
+    std::string body;
+    std::unique_ptr<MappedFile> file;
+    std::unique_ptr<ResponseTemplate> bodyTemplate;
+};
+
+// Configuration file of the standalone mock server. One directive per line; lines starting with '#' are comments:
+//   port <port>                        0: any free port
+//   threads <count>                    thread pool size
+//   shards <count>                     SO_REUSEPORT shards (0: one per core); replaces the thread pool
+//   connection-limit <count>
+//   connection-memory-limit <bytes>
+//   connection-timeout <seconds>
+//   listen-backlog <count>
+//   post-buffer-size <bytes>
+//   trace-buffer <requests per thread>
+//   turbo | tcp-fastopen
+//   route <GET|POST|*> <url|*> <status> <content type> inline <body ...>
+//   route <GET|POST|*> <url|*> <status> <content type> file <path>
+//   route <GET|POST|*> <url|*> <status> <content type> template <body with placeholders ...>
+//   header <name> <value ...>          additional response header of the preceding route
+// Requests without a matching route get 404. Routes with url "*" match if no route for the url exists.
+class MockConfiguration
+{
+public:
+    // throws std::runtime_error with the line number on errors
+    static std::shared_ptr<const MockConfiguration> load(const std::string &fileName);
+
+    int port{8080};
+    bool sharded{false};
+    unsigned shardCount{0};
+    ServerOptions options;
+
+    // fills the response; the configuration must outlive the request, see ConnectionData::responseBodyOwner
+    void generateResponse(const std::shared_ptr<const MockConfiguration> &self, ConnectionData *connectionData) const;
+    // generate response callback, which keeps the configuration alive; swapping it reloads the routes without a restart
+    static callbackFunction responseCallback(const std::shared_ptr<const MockConfiguration> &configuration);
+    size_t routeCount() const;
+
+private:
+    void parseLine(const std::string &line);
+    const MockRoute *findRoute(const ConnectionData &connectionData) const;
+    const MockRoute *findRoute(const std::string &url, HttpMethod httpMethod) const;
+
+    std::unordered_map<std::string, std::vector<MockRoute>> m_routes;
+    MockRoute *m_lastRoute{nullptr};
+    size_t m_routeCount{0};
+};
+
+}
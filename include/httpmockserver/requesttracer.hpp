@@ -0,0 +1,70 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <ostream>
+
+namespace httpmock
+{
+
+class ConnectionData;
+
+// Monotonic timestamps of the phases of one request; a phase, which hasn't been reached, has the default value
+struct RequestPhases
+{
+    std::chrono::steady_clock::time_point firstCallback;    // first call of onConnectionCallback (header parsed)
+    std::chrono::steady_clock::time_point uploadCompleted;  // the body has been received completely
+    std::chrono::steady_clock::time_point callbackEntered;  // the generate response callback is called
+    std::chrono::steady_clock::time_point callbackExited;
+    std::chrono::steady_clock::time_point responseQueued;   // MHD_queue_response has returned
+    std::chrono::steady_clock::time_point requestCompleted; // onRequestCompleted
+};
+
+// Collects the phases of completed requests in a fixed size buffer per polling thread and exports them as
+// Chrome trace events (https://docs.google.com/document/d/1CvAClvFfyA5R-PhYUmn5OOQtYMH4h6I0nSsKchNAySU), e.g. for Perfetto.
+// Recording doesn't lock and doesn't allocate, except for the first request of a thread; records beyond the capacity are dropped.
+class RequestTracer
+{
+public:
+    explicit RequestTracer(size_t capacityPerThread);
+
+    void record(const ConnectionData &connectionData);
+
+    // complete JSON document
+    void writeChromeTrace(std::ostream &output) const;
+    // only the events, separated by commas; first is set to false once an event has been written
+    void writeTraceEvents(std::ostream &output, bool &first, int processId) const;
+
+    size_t recordCount() const;
+    uint64_t droppedRecords() const;
+
+private:
+    struct Record
+    {
+        RequestPhases phases;
+        uint64_t requestId;
+        char url[64]; // truncated, zero terminated
+    };
+
+    struct ThreadBuffer
+    {
+        std::thread::id thread;
+        unsigned index;
+        std::unique_ptr<Record[]> records;
+        std::atomic<size_t> count{0}; // records below count are complete and immutable
+    };
+
+    ThreadBuffer *threadBuffer();
+
+    const uint64_t m_id;
+    const size_t m_capacityPerThread;
+    mutable std::mutex m_buffersMutex; // only for registering and iterating the buffers
+    std::vector<std::unique_ptr<ThreadBuffer>> m_buffers;
+    std::atomic<uint64_t> m_droppedRecords{0};
+};
+
+}
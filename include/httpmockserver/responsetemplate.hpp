@@ -0,0 +1,44 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace httpmock
+{
+
+class ConnectionData;
+
+// Response body or header template with placeholders, which are replaced by request data:
+//   {{url}}, {{version}}, {{header.<name>}}, {{arg.<name>}} (url argument), {{form.<name>}} (PostFormUrlEncoded field)
+// The template is parsed once into a segment list; render() doesn't allocate as long as the capacity of the output buffer suffices.
+class ResponseTemplate
+{
+public:
+    // throws std::invalid_argument for unterminated or unknown placeholders
+    explicit ResponseTemplate(const std::string &text);
+
+    void render(const ConnectionData &connectionData, std::string &output) const;
+
+private:
+    enum class SegmentType
+    {
+        Literal,
+        Url,
+        Version,
+        Header,
+        Argument,
+        Form
+    };
+
+    struct Segment
+    {
+        SegmentType type;
+        std::string text; // literal text or key of the placeholder
+    };
+
+    void parsePlaceholder(const std::string &placeholder);
+
+    std::vector<Segment> m_segments;
+};
+
+}
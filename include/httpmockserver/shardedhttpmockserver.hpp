@@ -0,0 +1,72 @@
+#pragma once
+
+#include "httpmockserver/httpmockserver.hpp"
+
+#include <vector>
+
+namespace httpmock
+{
+
+// Runs one HttpMockServer ("shard") per core on the same port. Every shard gets its own SO_REUSEPORT listen socket,
+// so the kernel distributes the incoming connections, and the polling thread of every shard is pinned to one of the
+// cpus of the process affinity mask (cpuset), in order.
+// The shards don't share any state: connection registry, metrics and history are merged only on request.
+class ShardedHttpMockServer
+{
+public:
+    // shardCount = 0: one shard per allowed cpu; port = 0: the kernel chooses a free port on every start, see port()
+    explicit ShardedHttpMockServer(int port = 8080, unsigned shardCount = 0);
+    ~ShardedHttpMockServer();
+    // options.threadPoolSize is ignored: every shard is polled by exactly one thread.
+    // options.connectionLimit is divided among the shards (rounded up). The kernel assigns a connection by a hash of its
+    // addresses and ports, not by the load of the shards: a shard may refuse connections before the total limit is reached.
+    void start(const ServerOptions &options = {});
+    void stop();
+    bool isRunning() const;
+
+    // Counts the completed requests of all shards since start()
+    bool waitForRequestCompleted(uint32_t count = 1, uint32_t timeoutMs = 0);
+    // Last completed request over all shards
+    ConnectionData *lastConnectionData();
+    // The callback is called concurrently from the polling threads of all shards
+    void setGenerateResponseCallback(const callbackFunction &newGenerateResponseCallback);
+    void setResponseTemplate(const std::string &bodyTemplate, const std::vector<std::pair<std::string, std::string>> &headerTemplates = {});
+    void clearResponseTemplate();
+
+    // WebSocket (requires ServerOptions::allowWebSocket). The callback is called from the read threads of the sessions of all shards.
+    void setWebSocketMessageCallback(const webSocketMessageCallback &newWebSocketMessageCallback);
+    // counts the open sessions of all shards
+    bool waitForWebSocketSessions(size_t count = 1, uint32_t timeoutMs = 0);
+    std::vector<std::shared_ptr<WebSocketSession>> webSocketSessions();
+    // returns the number of sessions reached over all shards
+    size_t broadcast(const WebSocketFrame &frame, size_t count = 1);
+
+    // merged over all shards; the connection ids are unique per shard only
+    ConnectionStatistics connectionStatistics() const;
+    std::vector<ConnectionRecord> connectionRecords() const;
+
+    // one process per shard in the trace
+    void writeChromeTrace(std::ostream &output) const;
+
+    // bound port while running, else the requested port
+    int port() const;
+    unsigned shardCount() const;
+    uint64_t completedRequestCount() const;
+    HttpMockServer &shard(unsigned index);
+
+private:
+    int createListenSocket(const ServerOptions &options);
+
+    std::vector<std::unique_ptr<HttpMockServer>> m_shards;
+    callbackFunction m_generateResponseCallback;
+    bool m_hasResponseTemplate{false};
+    std::string m_bodyTemplate;
+    std::vector<std::pair<std::string, std::string>> m_headerTemplates;
+    webSocketMessageCallback m_webSocketMessageCallback;
+    uint64_t m_waitedRequests{0};
+    int m_port;
+    int m_boundPort{0};
+    unsigned m_shardCount;
+};
+
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+#include <microhttpd.h>
+
+struct iovec;
+
+namespace httpmock
+{
+
+enum class WebSocketOpcode : uint8_t
+{
+    Continuation = 0x0,
+    Text         = 0x1,
+    Binary       = 0x2,
+    Close        = 0x8,
+    Ping         = 0x9,
+    Pong         = 0xA
+};
+
+class WebSocketSession;
+using webSocketMessageCallback = std::function<void (WebSocketSession &session, WebSocketOpcode opcode, const std::byte *data, size_t size)>;
+
+// Server frame (unmasked), which is encoded once and can be sent many times to many sessions without copying the payload
+class WebSocketFrame
+{
+public:
+    WebSocketFrame(WebSocketOpcode opcode, const void *data, size_t size);
+    explicit WebSocketFrame(const std::string &text);
+
+    const std::vector<std::byte> &encoded() const;
+    size_t payloadSize() const;
+
+private:
+    std::vector<std::byte> m_encoded;
+    size_t m_payloadSize;
+};
+
+// Upgraded connection (RFC 6455). The frames of the client are read and dispatched by an own thread;
+// the send functions may be called from any thread. A peer, which doesn't read for sendTimeoutMs, is disconnected,
+// so that a stalled peer blocks a sender at most for this time.
+class WebSocketSession : public std::enable_shared_from_this<WebSocketSession>
+{
+public:
+    WebSocketSession(const std::string &url, MHD_socket socket, MHD_UpgradeResponseHandle *upgradeHandle, const webSocketMessageCallback &onMessage,
+                     unsigned sendTimeoutMs = 1000);
+    ~WebSocketSession();
+    WebSocketSession(const WebSocketSession&) = delete;
+    WebSocketSession &operator=(const WebSocketSession&) = delete;
+
+    // extraIn: data, which libmicrohttpd has already read behind the HTTP header.
+    // The session must be owned by a std::shared_ptr: the read thread keeps it alive until it has handed the socket back.
+    void start(const char *extraIn, size_t extraInSize);
+
+    const std::string &url() const;
+    bool isOpen() const;
+
+    bool sendText(const std::string &text);
+    bool sendBinary(const void *data, size_t size);
+    // sends the frame count times; the writes are batched and reference the same buffer
+    bool send(const WebSocketFrame &frame, size_t count = 1);
+    void close(uint16_t statusCode = 1000);
+
+    // byte counters count the payload only
+    uint64_t receivedFrames() const;
+    uint64_t receivedBytes() const;
+    uint64_t sentFrames() const;
+    uint64_t sentBytes() const;
+
+    static std::string acceptKey(const std::string &clientKey);
+
+private:
+    friend class HttpMockServer;
+
+    // closes the session and waits for the read thread, which hands the socket back to libmicrohttpd (unless called by the read thread)
+    void terminate();
+    void readLoop();
+    // returns the number of consumed bytes, 0 if the frame is still incomplete
+    size_t processFrame(std::byte *data, size_t size, bool &closeReceived);
+    // waitForSender = false: gives up, if another thread is sending
+    bool sendFrame(WebSocketOpcode opcode, const void *data, size_t size, bool waitForSender = true);
+    bool writeAll(struct iovec *iov, int iovCount);
+    void shutdownSocket();
+
+    std::string m_url;
+    MHD_socket m_socket;
+    MHD_UpgradeResponseHandle *m_upgradeHandle;
+    webSocketMessageCallback m_onMessage;
+    unsigned m_sendTimeoutMs;
+    // called by the read thread, after it has handed the socket back (set by HttpMockServer)
+    std::function<void (WebSocketSession &session)> m_onFinished;
+
+    std::thread m_readThread;
+    std::atomic<bool> m_open{true};
+    std::mutex m_sendMutex;   // serializes the writers; held during a (time limited) write
+    bool m_closeSent{false};  // guarded by m_sendMutex
+    std::mutex m_socketMutex; // only held briefly: the socket must not be shut down after it has been handed back
+    bool m_socketReleased{false};
+
+    std::vector<std::byte> m_readBuffer;
+    size_t m_readBufferFill{0};
+    std::vector<std::byte> m_fragmentedMessage;
+    WebSocketOpcode m_fragmentedOpcode{WebSocketOpcode::Continuation};
+
+    std::atomic<uint64_t> m_receivedFrames{0};
+    std::atomic<uint64_t> m_receivedBytes{0};
+    std::atomic<uint64_t> m_sentFrames{0};
+    std::atomic<uint64_t> m_sentBytes{0};
+};
+
+}
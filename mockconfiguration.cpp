@@ -0,0 +1,249 @@
+#include "include/httpmockserver/mockconfiguration.hpp"
+
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace httpmock
+{
+
+namespace
+{
+
+std::string remainder(std::istringstream &stream)
+{
+    std::string text;
+    std::getline(stream >> std::ws, text);
+    return text;
+}
+
+template<typename T>
+T number(std::istringstream &stream, const std::string &directive)
+{
+    T value;
+    if(!(stream >> value))
+        throw std::runtime_error("missing or invalid number for '" + directive + "'");
+
+    return value;
+}
+
+}
+
+MappedFile::MappedFile(const std::string &fileName)
+{
+    int fileDescriptor = ::open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fileDescriptor < 0)
+        throw std::runtime_error("can't open '" + fileName + "'");
+
+    struct stat status;
+    if(::fstat(fileDescriptor, &status) != 0)
+    {
+        ::close(fileDescriptor);
+        throw std::runtime_error("can't stat '" + fileName + "'");
+    }
+
+    m_size = static_cast<size_t>(status.st_size);
+    if(m_size > 0)
+    {
+        m_address = ::mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fileDescriptor, 0);
+        if(m_address == MAP_FAILED)
+        {
+            m_address = nullptr;
+            ::close(fileDescriptor);
+            throw std::runtime_error("can't map '" + fileName + "'");
+        }
+    }
+
+    // the mapping stays valid without the file descriptor
+    ::close(fileDescriptor);
+}
+
+MappedFile::~MappedFile()
+{
+    if(m_address)
+        ::munmap(m_address, m_size);
+}
+
+std::string_view MappedFile::data() const
+{
+    return std::string_view(static_cast<const char *>(m_address), m_size);
+}
+
+std::shared_ptr<const MockConfiguration> MockConfiguration::load(const std::string &fileName)
+{
+    std::ifstream file(fileName);
+    if(!file)
+        throw std::runtime_error("can't open configuration '" + fileName + "'");
+
+    std::shared_ptr<MockConfiguration> configuration = std::make_shared<MockConfiguration>();
+
+    std::string line;
+    for(unsigned lineNumber = 1; std::getline(file, line); ++lineNumber)
+    {
+        try
+        {
+            configuration->parseLine(line);
+        }
+        catch(const std::exception &exception)
+        {
+            throw std::runtime_error(fileName + ":" + std::to_string(lineNumber) + ": " + exception.what());
+        }
+    }
+
+    return configuration;
+}
+
+void MockConfiguration::parseLine(const std::string &line)
+{
+    // '#' is a comment only at the beginning of a line: urls and bodies may contain it
+    std::istringstream stream(line);
+    std::string directive;
+    if(!(stream >> directive) || (directive.front() == '#'))
+        return;
+
+    if(directive == "port")
+        port = number<int>(stream, directive);
+    else if(directive == "threads")
+        options.threadPoolSize = number<unsigned>(stream, directive);
+    else if(directive == "shards")
+    {
+        sharded = true;
+        shardCount = number<unsigned>(stream, directive);
+    }
+    else if(directive == "connection-limit")
+        options.connectionLimit = number<unsigned>(stream, directive);
+    else if(directive == "connection-memory-limit")
+        options.connectionMemoryLimit = number<size_t>(stream, directive);
+    else if(directive == "connection-timeout")
+        options.connectionTimeoutSec = number<unsigned>(stream, directive);
+    else if(directive == "listen-backlog")
+        options.listenBacklogSize = number<unsigned>(stream, directive);
+    else if(directive == "post-buffer-size")
+        options.postProcessorBufferSize = number<size_t>(stream, directive);
+    else if(directive == "trace-buffer")
+        options.traceBufferSize = number<size_t>(stream, directive);
+    else if(directive == "turbo")
+        options.turbo = true;
+    else if(directive == "tcp-fastopen")
+        options.tcpFastOpen = true;
+    else if(directive == "route")
+    {
+        std::string method, url, contentType, bodyKind;
+        if(!(stream >> method >> url))
+            throw std::runtime_error("route requires method and url");
+
+        MockRoute route;
+        if(method == "GET")
+            route.method = MockRoute::Method::Get;
+        else if(method == "POST")
+            route.method = MockRoute::Method::Post;
+        else if(method != "*")
+            throw std::runtime_error("unsupported method '" + method + "'");
+
+        route.responseCode = number<int>(stream, directive);
+        if(!(stream >> contentType >> bodyKind))
+            throw std::runtime_error("route requires content type and body");
+
+        route.header.emplace_back("Content-Type", contentType);
+
+        const std::string body = remainder(stream);
+        if(bodyKind == "inline")
+            route.body = body;
+        else if(bodyKind == "file")
+            route.file = std::make_unique<MappedFile>(body);
+        else if(bodyKind == "template")
+            route.bodyTemplate = std::make_unique<ResponseTemplate>(body);
+        else
+            throw std::runtime_error("unknown body kind '" + bodyKind + "'");
+
+        std::vector<MockRoute> &routes = m_routes[url];
+        routes.push_back(std::move(route));
+        m_lastRoute = &routes.back();
+        m_routeCount++;
+    }
+    else if(directive == "header")
+    {
+        std::string name;
+        if(!(stream >> name))
+            throw std::runtime_error("header requires a name");
+
+        if(m_lastRoute == nullptr)
+            throw std::runtime_error("header without route");
+
+        if(!name.empty() && name.back() == ':')
+            name.pop_back();
+
+        m_lastRoute->header.emplace_back(name, remainder(stream));
+    }
+    else
+        throw std::runtime_error("unknown directive '" + directive + "'");
+}
+
+const MockRoute *MockConfiguration::findRoute(const ConnectionData &connectionData) const
+{
+    static const std::string anyUrl("*");
+
+    if(const MockRoute *route = findRoute(connectionData.url, connectionData.httpMethod))
+        return route;
+
+    return findRoute(anyUrl, connectionData.httpMethod);
+}
+
+const MockRoute *MockConfiguration::findRoute(const std::string &url, HttpMethod httpMethod) const
+{
+    auto entry = m_routes.find(url);
+    if(entry == m_routes.end())
+        return nullptr;
+
+    const MockRoute::Method method = (httpMethod == HttpMethod::Get) ? MockRoute::Method::Get : MockRoute::Method::Post;
+    for(auto &route : entry->second)
+    {
+        if((route.method == MockRoute::Method::Any) || (route.method == method))
+            return &route;
+    }
+
+    return nullptr;
+}
+
+void MockConfiguration::generateResponse(const std::shared_ptr<const MockConfiguration> &self, ConnectionData *connectionData) const
+{
+    const MockRoute *route = findRoute(*connectionData);
+    if(route == nullptr)
+    {
+        connectionData->responseCode = MHD_HTTP_NOT_FOUND;
+        return;
+    }
+
+    connectionData->responseCode = route->responseCode;
+    for(auto &entry : route->header)
+        connectionData->responseHeader[entry.first] = entry.second;
+
+    if(route->bodyTemplate)
+        route->bodyTemplate->render(*connectionData, connectionData->responseBody);
+    else
+    {
+        // no copy: the configuration stays alive until the request is completed, also if it is reloaded meanwhile
+        connectionData->responseBodyView = route->file ? route->file->data() : std::string_view(route->body);
+        connectionData->responseBodyOwner = self;
+    }
+}
+
+callbackFunction MockConfiguration::responseCallback(const std::shared_ptr<const MockConfiguration> &configuration)
+{
+    return [configuration](ConnectionData *connectionData)
+    {
+        configuration->generateResponse(configuration, connectionData);
+    };
+}
+
+size_t MockConfiguration::routeCount() const
+{
+    return m_routeCount;
+}
+
+}
@@ -0,0 +1,173 @@
+#include "include/httpmockserver/requesttracer.hpp"
+#include "include/httpmockserver/httpmockserver.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <iomanip>
+
+namespace httpmock
+{
+
+namespace
+{
+
+std::atomic<uint64_t> nextTracerId{1};
+
+double microseconds(std::chrono::steady_clock::time_point timePoint)
+{
+    return std::chrono::duration<double, std::micro>(timePoint.time_since_epoch()).count();
+}
+
+void writeJsonString(std::ostream &output, const char *text)
+{
+    output << '"';
+    for(const char *character = text; *character; ++character)
+    {
+        switch(*character)
+        {
+        case '"':  output << "\\\""; break;
+        case '\\': output << "\\\\"; break;
+        default:
+            if(static_cast<unsigned char>(*character) < 0x20)
+                output << ' ';
+            else
+                output << *character;
+        }
+    }
+    output << '"';
+}
+
+void writeCompleteEvent(std::ostream &output, bool &first, const char *name, const char *url, uint64_t requestId, int processId, unsigned threadId,
+                        std::chrono::steady_clock::time_point begin, std::chrono::steady_clock::time_point end)
+{
+    // phases, which have not been reached, are skipped
+    if((begin == std::chrono::steady_clock::time_point()) || (end < begin))
+        return;
+
+    if(!first)
+        output << ",\n";
+    first = false;
+
+    output << "{\"name\":";
+    writeJsonString(output, name ? name : url);
+    output << ",\"cat\":\"http\",\"ph\":\"X\",\"ts\":" << microseconds(begin) << ",\"dur\":" << microseconds(end) - microseconds(begin)
+           << ",\"pid\":" << processId << ",\"tid\":" << threadId << ",\"args\":{\"request\":" << requestId << ",\"url\":";
+    writeJsonString(output, url);
+    output << "}}";
+}
+
+}
+
+RequestTracer::RequestTracer(size_t capacityPerThread)
+ : m_id(nextTracerId++)
+ , m_capacityPerThread(capacityPerThread)
+{
+}
+
+void RequestTracer::record(const ConnectionData &connectionData)
+{
+    ThreadBuffer *buffer = threadBuffer();
+
+    // only the owning thread writes, so the count can't change meanwhile
+    const size_t index = buffer->count.load(std::memory_order_relaxed);
+    if(index >= m_capacityPerThread)
+    {
+        m_droppedRecords.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    Record &record = buffer->records[index];
+    record.phases = connectionData.phases;
+    record.requestId = connectionData.requestId;
+    const size_t urlSize = std::min(connectionData.url.size(), sizeof(record.url) - 1);
+    std::memcpy(record.url, connectionData.url.data(), urlSize);
+    record.url[urlSize] = '\0';
+
+    buffer->count.store(index + 1, std::memory_order_release);
+}
+
+void RequestTracer::writeChromeTrace(std::ostream &output) const
+{
+    bool first = true;
+    output << "{\"traceEvents\":[\n";
+    writeTraceEvents(output, first, 1);
+    output << "\n],\"displayTimeUnit\":\"ms\"}\n";
+}
+
+void RequestTracer::writeTraceEvents(std::ostream &output, bool &first, int processId) const
+{
+    // microseconds with nanosecond resolution; the default precision of 6 digits would round the absolute timestamps
+    const std::ios_base::fmtflags flags = output.flags();
+    const std::streamsize precision = output.precision();
+    output << std::fixed << std::setprecision(3);
+
+    std::lock_guard<std::mutex> lock(m_buffersMutex);
+    for(auto &buffer : m_buffers)
+    {
+        const size_t count = buffer->count.load(std::memory_order_acquire);
+        for(size_t i=0; i<count; ++i)
+        {
+            const Record &record = buffer->records[i];
+            const RequestPhases &phases = record.phases;
+            const unsigned threadId = buffer->index;
+
+            writeCompleteEvent(output, first, nullptr,    record.url, record.requestId, processId, threadId, phases.firstCallback,   phases.requestCompleted);
+            writeCompleteEvent(output, first, "upload",   record.url, record.requestId, processId, threadId, phases.firstCallback,   phases.uploadCompleted);
+            writeCompleteEvent(output, first, "generate", record.url, record.requestId, processId, threadId, phases.uploadCompleted, phases.responseQueued);
+            writeCompleteEvent(output, first, "callback", record.url, record.requestId, processId, threadId, phases.callbackEntered, phases.callbackExited);
+            writeCompleteEvent(output, first, "transmit", record.url, record.requestId, processId, threadId, phases.responseQueued,  phases.requestCompleted);
+        }
+    }
+
+    output.flags(flags);
+    output.precision(precision);
+}
+
+size_t RequestTracer::recordCount() const
+{
+    std::lock_guard<std::mutex> lock(m_buffersMutex);
+
+    size_t count = 0;
+    for(auto &buffer : m_buffers)
+        count += buffer->count.load(std::memory_order_acquire);
+
+    return count;
+}
+
+uint64_t RequestTracer::droppedRecords() const
+{
+    return m_droppedRecords;
+}
+
+RequestTracer::ThreadBuffer *RequestTracer::threadBuffer()
+{
+    // the tracer id instead of the address: a new tracer may get the address of a deleted one
+    thread_local uint64_t cachedTracerId = 0;
+    thread_local ThreadBuffer *cachedBuffer = nullptr;
+    if(cachedTracerId == m_id)
+        return cachedBuffer;
+
+    std::lock_guard<std::mutex> lock(m_buffersMutex);
+    ThreadBuffer *buffer = nullptr;
+    for(auto &entry : m_buffers)
+    {
+        if(entry->thread == std::this_thread::get_id())
+            buffer = entry.get();
+    }
+
+    if(buffer == nullptr)
+    {
+        std::unique_ptr<ThreadBuffer> newBuffer = std::make_unique<ThreadBuffer>();
+        newBuffer->thread = std::this_thread::get_id();
+        newBuffer->index = static_cast<unsigned>(m_buffers.size() + 1);
+        newBuffer->records = std::make_unique<Record[]>(m_capacityPerThread);
+        buffer = newBuffer.get();
+        m_buffers.push_back(std::move(newBuffer));
+    }
+
+    cachedTracerId = m_id;
+    cachedBuffer = buffer;
+    return buffer;
+}
+
+}
@@ -0,0 +1,132 @@
+#include "include/httpmockserver/responsetemplate.hpp"
+#include "include/httpmockserver/httpmockserver.hpp"
+
+#include <stdexcept>
+#include <strings.h>
+
+namespace httpmock
+{
+
+namespace
+{
+
+const std::string *findValue(const std::unordered_map<std::string, std::string> &container, const std::string &key)
+{
+    auto entry = container.find(key);
+    return (entry != container.end()) ? &entry->second : nullptr;
+}
+
+const std::string *findHeaderValue(const std::unordered_map<std::string, std::string> &header, const std::string &key)
+{
+    if(const std::string *value = findValue(header, key))
+        return value;
+
+    // HTTP header names are case-insensitive
+    for(auto &entry : header)
+    {
+        if(strcasecmp(entry.first.c_str(), key.c_str()) == 0)
+            return &entry.second;
+    }
+
+    return nullptr;
+}
+
+}
+
+ResponseTemplate::ResponseTemplate(const std::string &text)
+{
+    size_t position = 0;
+    while(position < text.size())
+    {
+        size_t placeholderBegin = text.find("{{", position);
+        if(placeholderBegin == std::string::npos)
+        {
+            m_segments.push_back({SegmentType::Literal, text.substr(position)});
+            break;
+        }
+
+        if(placeholderBegin > position)
+            m_segments.push_back({SegmentType::Literal, text.substr(position, placeholderBegin - position)});
+
+        size_t placeholderEnd = text.find("}}", placeholderBegin + 2);
+        if(placeholderEnd == std::string::npos)
+            throw std::invalid_argument("ResponseTemplate: unterminated placeholder at position " + std::to_string(placeholderBegin));
+
+        parsePlaceholder(text.substr(placeholderBegin + 2, placeholderEnd - placeholderBegin - 2));
+        position = placeholderEnd + 2;
+    }
+}
+
+void ResponseTemplate::parsePlaceholder(const std::string &placeholder)
+{
+    static const struct
+    {
+        const char *prefix;
+        SegmentType type;
+    } keyedPlaceholders[] =
+    {
+        {"header.", SegmentType::Header},
+        {"arg.",    SegmentType::Argument},
+        {"form.",   SegmentType::Form}
+    };
+
+    if(placeholder == "url")
+    {
+        m_segments.push_back({SegmentType::Url, {}});
+        return;
+    }
+
+    if(placeholder == "version")
+    {
+        m_segments.push_back({SegmentType::Version, {}});
+        return;
+    }
+
+    for(auto &entry : keyedPlaceholders)
+    {
+        const std::string prefix(entry.prefix);
+        if((placeholder.size() > prefix.size()) && (placeholder.compare(0, prefix.size(), prefix) == 0))
+        {
+            m_segments.push_back({entry.type, placeholder.substr(prefix.size())});
+            return;
+        }
+    }
+
+    throw std::invalid_argument("ResponseTemplate: unknown placeholder {{" + placeholder + "}}");
+}
+
+void ResponseTemplate::render(const ConnectionData &connectionData, std::string &output) const
+{
+    output.clear();
+
+    for(auto &segment : m_segments)
+    {
+        const std::string *value = nullptr;
+        switch(segment.type)
+        {
+        case SegmentType::Literal:
+            value = &segment.text;
+            break;
+        case SegmentType::Url:
+            value = &connectionData.url;
+            break;
+        case SegmentType::Version:
+            value = &connectionData.version;
+            break;
+        case SegmentType::Header:
+            value = findHeaderValue(connectionData.header, segment.text);
+            break;
+        case SegmentType::Argument:
+            value = findValue(connectionData.urlArguments, segment.text);
+            break;
+        case SegmentType::Form:
+            value = findValue(connectionData.postUrlEncoded, segment.text);
+            break;
+        }
+
+        if(value)
+            output.append(*value);
+    }
+}
+
+}
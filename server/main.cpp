@@ -0,0 +1,94 @@
+#include "httpmockserver/mockconfiguration.hpp"
+#include "httpmockserver/shardedhttpmockserver.hpp"
+
+#include <iostream>
+#include <csignal>
+
+#include <pthread.h>
+
+using namespace httpmock;
+
+int main(int argc, char *argv[])
+{
+    if(argc != 2)
+    {
+        std::cerr << "usage: " << argv[0] << " <configuration file>" << std::endl;
+        return 2;
+    }
+
+    // Blocked before any thread is started, so that all signals arrive at sigwait() below
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    std::shared_ptr<const MockConfiguration> configuration;
+    try
+    {
+        configuration = MockConfiguration::load(argv[1]);
+    }
+    catch(const std::exception &exception)
+    {
+        std::cerr << exception.what() << std::endl;
+        return 1;
+    }
+
+    std::unique_ptr<HttpMockServer> server;
+    std::unique_ptr<ShardedHttpMockServer> shardedServer;
+    try
+    {
+        if(configuration->sharded)
+        {
+            shardedServer = std::make_unique<ShardedHttpMockServer>(configuration->port, configuration->shardCount);
+            shardedServer->setGenerateResponseCallback(MockConfiguration::responseCallback(configuration));
+            shardedServer->start(configuration->options);
+            std::cout << "listening on port " << shardedServer->port() << " with " << shardedServer->shardCount() << " shards" << std::endl;
+        }
+        else
+        {
+            server = std::make_unique<HttpMockServer>(configuration->port);
+            server->setGenerateResponseCallback(MockConfiguration::responseCallback(configuration));
+            server->start(configuration->options);
+            std::cout << "listening on port " << server->port() << std::endl;
+        }
+    }
+    catch(const std::exception &exception)
+    {
+        std::cerr << exception.what() << std::endl;
+        return 1;
+    }
+
+    std::cout << configuration->routeCount() << " routes loaded from " << argv[1] << std::endl;
+
+    for(;;)
+    {
+        int signal = 0;
+        if(sigwait(&signals, &signal) != 0)
+            continue;
+
+        if(signal != SIGHUP)
+            break;
+
+        // The swap doesn't drop any connection: running requests finish with the old configuration, which is kept
+        // alive by their ConnectionData, and new requests see the new one
+        try
+        {
+            configuration = MockConfiguration::load(argv[1]);
+            if(shardedServer)
+                shardedServer->setGenerateResponseCallback(MockConfiguration::responseCallback(configuration));
+            else
+                server->setGenerateResponseCallback(MockConfiguration::responseCallback(configuration));
+
+            std::cout << configuration->routeCount() << " routes reloaded (server options take effect after a restart)" << std::endl;
+        }
+        catch(const std::exception &exception)
+        {
+            std::cerr << "reload failed, keeping the previous configuration: " << exception.what() << std::endl;
+        }
+    }
+
+    std::cout << "stopping" << std::endl;
+    return 0;
+}
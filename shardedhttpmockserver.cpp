@@ -0,0 +1,323 @@
+#include "include/httpmockserver/shardedhttpmockserver.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+#include <thread>
+
+#include <sched.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+
+namespace httpmock
+{
+
+namespace
+{
+
+// CPUs this process may run on (cpuset / taskset), empty if unknown
+std::vector<int> allowedCpus()
+{
+    std::vector<int> cpus;
+#ifdef __linux__
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    if(sched_getaffinity(0, sizeof(cpuSet), &cpuSet) == 0)
+    {
+        for(int cpu=0; cpu<CPU_SETSIZE; ++cpu)
+            if(CPU_ISSET(cpu, &cpuSet))
+                cpus.push_back(cpu);
+    }
+#endif
+    return cpus;
+}
+
+}
+
+ShardedHttpMockServer::ShardedHttpMockServer(int port, unsigned shardCount)
+ : m_port(port)
+ , m_shardCount(shardCount)
+{
+    if(m_shardCount == 0)
+    {
+        size_t cpuCount = allowedCpus().size();
+        m_shardCount = (cpuCount > 0) ? static_cast<unsigned>(cpuCount) : std::max(1u, std::thread::hardware_concurrency());
+    }
+}
+
+ShardedHttpMockServer::~ShardedHttpMockServer()
+{
+    stop();
+}
+
+void ShardedHttpMockServer::start(const ServerOptions &options)
+{
+    stop();
+    m_waitedRequests = 0;
+    m_boundPort = m_port;
+
+    // shard i is pinned to the i-th allowed cpu, so a restricted cpuset is filled in order
+    const std::vector<int> cpus = allowedCpus();
+    int listenSocket = -1;
+
+    ServerOptions shardOptions = options;
+    if(options.connectionLimit > 0)
+        shardOptions.connectionLimit = (options.connectionLimit + m_shardCount - 1) / m_shardCount;
+
+    try
+    {
+        for(unsigned i=0; i<m_shardCount; ++i)
+        {
+            listenSocket = createListenSocket(shardOptions);
+
+            std::unique_ptr<HttpMockServer> shard = std::make_unique<HttpMockServer>(m_boundPort);
+            shard->setGenerateResponseCallback(m_generateResponseCallback);
+            shard->setWebSocketMessageCallback(m_webSocketMessageCallback);
+            if(m_hasResponseTemplate)
+                shard->setResponseTemplate(m_bodyTemplate, m_headerTemplates);
+
+            shard->startOnListenSocket(listenSocket, cpus.empty() ? -1 : cpus[i % cpus.size()], shardOptions);
+            // the daemon owns the socket from now on
+            listenSocket = -1;
+
+            m_shards.push_back(std::move(shard));
+        }
+    }
+    catch(...)
+    {
+        if(listenSocket >= 0)
+            ::close(listenSocket);
+
+        stop();
+        throw;
+    }
+}
+
+void ShardedHttpMockServer::stop()
+{
+    m_shards.clear();
+}
+
+bool ShardedHttpMockServer::isRunning() const
+{
+    return !m_shards.empty();
+}
+
+bool ShardedHttpMockServer::waitForRequestCompleted(uint32_t count, uint32_t timeoutMs)
+{
+    // The shards have no common condition variable (this would be shared state in the hot path), so we poll the counters
+    const uint64_t expectedRequests = m_waitedRequests + count;
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+
+    while(completedRequestCount() < expectedRequests)
+    {
+        if((timeoutMs != 0) && (std::chrono::steady_clock::now() >= deadline))
+            return false;
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    m_waitedRequests = expectedRequests;
+    return true;
+}
+
+ConnectionData *ShardedHttpMockServer::lastConnectionData()
+{
+    HttpMockServer *lastShard = nullptr;
+    for(auto &shard : m_shards)
+    {
+        if(shard->completedRequestCount() == 0)
+            continue;
+
+        if((lastShard == nullptr) || (shard->lastCompletedTime() > lastShard->lastCompletedTime()))
+            lastShard = shard.get();
+    }
+
+    return lastShard ? lastShard->lastConnectionData() : nullptr;
+}
+
+void ShardedHttpMockServer::setGenerateResponseCallback(const callbackFunction &newGenerateResponseCallback)
+{
+    m_generateResponseCallback = newGenerateResponseCallback;
+    for(auto &shard : m_shards)
+        shard->setGenerateResponseCallback(newGenerateResponseCallback);
+}
+
+void ShardedHttpMockServer::setResponseTemplate(const std::string &bodyTemplate, const std::vector<std::pair<std::string, std::string>> &headerTemplates)
+{
+    // validates the templates also if no shard is running
+    (void)ResponseTemplate(bodyTemplate);
+    for(auto &entry : headerTemplates)
+        (void)ResponseTemplate(entry.second);
+
+    m_hasResponseTemplate = true;
+    m_bodyTemplate = bodyTemplate;
+    m_headerTemplates = headerTemplates;
+    for(auto &shard : m_shards)
+        shard->setResponseTemplate(bodyTemplate, headerTemplates);
+}
+
+void ShardedHttpMockServer::clearResponseTemplate()
+{
+    m_hasResponseTemplate = false;
+    m_bodyTemplate.clear();
+    m_headerTemplates.clear();
+    for(auto &shard : m_shards)
+        shard->clearResponseTemplate();
+}
+
+void ShardedHttpMockServer::setWebSocketMessageCallback(const webSocketMessageCallback &newWebSocketMessageCallback)
+{
+    m_webSocketMessageCallback = newWebSocketMessageCallback;
+    for(auto &shard : m_shards)
+        shard->setWebSocketMessageCallback(newWebSocketMessageCallback);
+}
+
+bool ShardedHttpMockServer::waitForWebSocketSessions(size_t count, uint32_t timeoutMs)
+{
+    // polled like waitForRequestCompleted(): every shard has its own condition variable
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+
+    while(webSocketSessions().size() < count)
+    {
+        if((timeoutMs != 0) && (std::chrono::steady_clock::now() >= deadline))
+            return false;
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    return true;
+}
+
+std::vector<std::shared_ptr<WebSocketSession>> ShardedHttpMockServer::webSocketSessions()
+{
+    std::vector<std::shared_ptr<WebSocketSession>> sessions;
+    for(auto &shard : m_shards)
+    {
+        std::vector<std::shared_ptr<WebSocketSession>> shardSessions = shard->webSocketSessions();
+        sessions.insert(sessions.end(), shardSessions.begin(), shardSessions.end());
+    }
+
+    return sessions;
+}
+
+size_t ShardedHttpMockServer::broadcast(const WebSocketFrame &frame, size_t count)
+{
+    size_t reached = 0;
+    for(auto &shard : m_shards)
+        reached += shard->broadcast(frame, count);
+
+    return reached;
+}
+
+ConnectionStatistics ShardedHttpMockServer::connectionStatistics() const
+{
+    ConnectionStatistics statistics;
+    for(auto &shard : m_shards)
+    {
+        ConnectionStatistics shardStatistics = shard->connectionStatistics();
+        statistics.connections += shardStatistics.connections;
+        statistics.openConnections += shardStatistics.openConnections;
+        statistics.requests += shardStatistics.requests;
+        statistics.reusedRequests += shardStatistics.reusedRequests;
+        statistics.maxRequestsPerConnection = std::max(statistics.maxRequestsPerConnection, shardStatistics.maxRequestsPerConnection);
+    }
+
+    return statistics;
+}
+
+std::vector<ConnectionRecord> ShardedHttpMockServer::connectionRecords() const
+{
+    std::vector<ConnectionRecord> records;
+    for(auto &shard : m_shards)
+    {
+        std::vector<ConnectionRecord> shardRecords = shard->connectionRecords();
+        records.insert(records.end(), shardRecords.begin(), shardRecords.end());
+    }
+
+    return records;
+}
+
+void ShardedHttpMockServer::writeChromeTrace(std::ostream &output) const
+{
+    bool first = true;
+    output << "{\"traceEvents\":[\n";
+    for(size_t i=0; i<m_shards.size(); ++i)
+        m_shards[i]->writeTraceEvents(output, first, static_cast<int>(i + 1));
+    output << "\n],\"displayTimeUnit\":\"ms\"}\n";
+}
+
+int ShardedHttpMockServer::port() const
+{
+    return isRunning() ? m_boundPort : m_port;
+}
+
+unsigned ShardedHttpMockServer::shardCount() const
+{
+    return m_shardCount;
+}
+
+uint64_t ShardedHttpMockServer::completedRequestCount() const
+{
+    uint64_t count = 0;
+    for(auto &shard : m_shards)
+        count += shard->completedRequestCount();
+
+    return count;
+}
+
+HttpMockServer &ShardedHttpMockServer::shard(unsigned index)
+{
+    return *m_shards.at(index);
+}
+
+int ShardedHttpMockServer::createListenSocket(const ServerOptions &options)
+{
+    int listenSocket = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(listenSocket < 0)
+        throw std::runtime_error("ShardedHttpMockServer has failed to create a socket!");
+
+    int enable = 1;
+    if(    (::setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) != 0)
+        || (::setsockopt(listenSocket, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) != 0))
+    {
+        ::close(listenSocket);
+        throw std::runtime_error("ShardedHttpMockServer has failed to set SO_REUSEPORT!");
+    }
+
+    // libmicrohttpd only enables TCP fast open on the sockets it creates itself; 10 is its default queue size
+    if(options.tcpFastOpen)
+    {
+        int queueSize = (options.tcpFastOpenQueueSize > 0) ? static_cast<int>(options.tcpFastOpenQueueSize) : 10;
+        if(::setsockopt(listenSocket, IPPROTO_TCP, TCP_FASTOPEN, &queueSize, sizeof(queueSize)) != 0)
+        {
+            ::close(listenSocket);
+            throw std::runtime_error("ShardedHttpMockServer has failed to set TCP_FASTOPEN!");
+        }
+    }
+
+    struct sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(static_cast<uint16_t>(m_boundPort));
+
+    if(    (::bind(listenSocket, reinterpret_cast<struct sockaddr *>(&address), sizeof(address)) != 0)
+        || (::listen(listenSocket, (options.listenBacklogSize > 0) ? static_cast<int>(options.listenBacklogSize) : SOMAXCONN) != 0))
+    {
+        ::close(listenSocket);
+        throw std::runtime_error("ShardedHttpMockServer has failed to bind port " + std::to_string(m_boundPort) + "!");
+    }
+
+    // port 0: all further shards must bind the port the kernel has chosen for the first one (see HttpMockServer::start)
+    if(m_boundPort == 0)
+    {
+        socklen_t addressLength = sizeof(address);
+        if(::getsockname(listenSocket, reinterpret_cast<struct sockaddr *>(&address), &addressLength) == 0)
+            m_boundPort = ntohs(address.sin_port);
+    }
+
+    return listenSocket;
+}
+
+}
@@ -1,13 +1,27 @@
 #include "httpmockserver/httpmockserver.hpp"
+#include "httpmockserver/shardedhttpmockserver.hpp"
 
 #include <string>
 #include <iostream>
 #include <cstring>
 #include <regex>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <sstream>
+#include <vector>
+#include <future>
+#include <algorithm>
+#include <cctype>
 
 #include <gmock/gmock.h>
 #include <curl/curl.h>
 
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
 int port = 57567;
 
 std::string receiveBuffer;
@@ -200,6 +214,951 @@ TEST(HttpMockServer, PostRawData)
     EXPECT_EQ(std::memcmp(mockServer.lastConnectionData()->postData.data(), content.c_str(), content.size()), 0);
 }
 
+TEST(HttpMockServer, ServerOptions)
+{
+    std::string url = "/options-url";
+    const char urlFields[] = "name=daniel&project=curl";
+
+    httpmock::ServerOptions options;
+    options.connectionLimit = 16;
+    options.connectionMemoryLimit = 32 * 1024;
+    options.connectionTimeoutSec = 5;
+    options.listenBacklogSize = 64;
+    options.turbo = true;
+    options.postProcessorBufferSize = 1024;
+    options.threadPoolSize = 4;
+
+    httpmock::HttpMockServer mockServer(port);
+    mockServer.start(options);
+    EXPECT_TRUE(mockServer.isRunning());
+
+    CURL *curlHandle = curl_easy_init();
+    EXPECT_NE(curlHandle, nullptr);
+
+    std::string requestUrl = "http://127.0.0.1:" + std::to_string(port) + url;
+    curl_easy_setopt(curlHandle, CURLOPT_URL, requestUrl.c_str());
+    curl_easy_setopt(curlHandle, CURLOPT_POSTFIELDS, urlFields);
+
+    CURLcode returnCode = curl_easy_perform(curlHandle);
+    EXPECT_EQ(returnCode, CURLE_OK) << curl_easy_strerror(returnCode);
+
+    long httpResponseCode;
+    curl_easy_getinfo(curlHandle, CURLINFO_RESPONSE_CODE, &httpResponseCode);
+    curl_easy_cleanup(curlHandle);
+    EXPECT_TRUE(mockServer.waitForRequestCompleted(1, 1000));
+
+    EXPECT_EQ(httpResponseCode, 200);
+    EXPECT_EQ(mockServer.lastConnectionData()->httpMethod, httpmock::HttpMethod::PostFormUrlEncoded);
+    EXPECT_TRUE(mockServer.lastConnectionData()->postUrlEncoded["name"]    == "daniel");
+    EXPECT_TRUE(mockServer.lastConnectionData()->postUrlEncoded["project"] == "curl");
+    mockServer.stop();
+
+    options.postProcessorBufferSize = 16;
+    EXPECT_THROW(mockServer.start(options), std::invalid_argument);
+}
+
+static int connectedSocket(int serverPort)
+{
+    int clientSocket = socket(AF_INET, SOCK_STREAM, 0);
+    if(clientSocket < 0)
+        return -1;
+
+    struct sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(static_cast<uint16_t>(serverPort));
+    inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+    if(connect(clientSocket, reinterpret_cast<struct sockaddr *>(&address), sizeof(address)) != 0)
+    {
+        close(clientSocket);
+        return -1;
+    }
+
+    return clientSocket;
+}
+
+static std::string receiveExactly(int socket, size_t size)
+{
+    std::string data(size, '\0');
+    size_t received = 0;
+    while(received < size)
+    {
+        ssize_t result = recv(socket, &data[received], size - received, 0);
+        if(result <= 0)
+            break;
+        received += static_cast<size_t>(result);
+    }
+
+    data.resize(received);
+    return data;
+}
+
+// reads the response header byte by byte, so that nothing behind it is consumed
+static std::string receiveHeader(int socket)
+{
+    std::string header;
+    while(header.find("\r\n\r\n") == std::string::npos)
+    {
+        std::string character = receiveExactly(socket, 1);
+        if(character.empty())
+            break;
+        header += character;
+    }
+
+    return header;
+}
+
+static bool waitForOpenConnections(httpmock::HttpMockServer &mockServer, uint64_t count, uint32_t timeoutMs)
+{
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    while(mockServer.connectionStatistics().openConnections != count)
+    {
+        if(std::chrono::steady_clock::now() >= deadline)
+            return false;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    return true;
+}
+
+TEST(HttpMockServer, ServerOptionsConnectionLimit)
+{
+    std::string requestUrl = "http://127.0.0.1:" + std::to_string(port) + "/limit-url";
+
+    httpmock::ServerOptions options;
+    options.connectionLimit = 1;
+
+    httpmock::HttpMockServer mockServer(port);
+    mockServer.start(options);
+    EXPECT_TRUE(mockServer.isRunning());
+
+    // an idle connection takes the only slot
+    int idleSocket = connectedSocket(port);
+    ASSERT_GE(idleSocket, 0);
+    ASSERT_TRUE(waitForOpenConnections(mockServer, 1, 1000));
+
+    // libmicrohttpd refuses or doesn't accept the second connection
+    CURL *curlHandle = curl_easy_init();
+    curl_easy_setopt(curlHandle, CURLOPT_URL, requestUrl.c_str());
+    curl_easy_setopt(curlHandle, CURLOPT_WRITEFUNCTION, CurlWriteMemoryCallback);
+    curl_easy_setopt(curlHandle, CURLOPT_TIMEOUT_MS, 500L);
+    EXPECT_NE(curl_easy_perform(curlHandle), CURLE_OK);
+    EXPECT_EQ(mockServer.completedRequestCount(), 0);
+
+    // the slot is free again
+    close(idleSocket);
+    curl_easy_setopt(curlHandle, CURLOPT_TIMEOUT_MS, 5000L);
+    CURLcode returnCode = curl_easy_perform(curlHandle);
+    EXPECT_EQ(returnCode, CURLE_OK) << curl_easy_strerror(returnCode);
+    curl_easy_cleanup(curlHandle);
+    EXPECT_TRUE(mockServer.waitForRequestCompleted(1, 1000));
+}
+
+TEST(HttpMockServer, ServerOptionsConnectionTimeout)
+{
+    httpmock::ServerOptions options;
+    options.connectionTimeoutSec = 1;
+
+    httpmock::HttpMockServer mockServer(port);
+    mockServer.start(options);
+    EXPECT_TRUE(mockServer.isRunning());
+
+    int clientSocket = connectedSocket(port);
+    ASSERT_GE(clientSocket, 0);
+
+    std::string request = "GET /timeout-url HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n";
+    send(clientSocket, request.data(), request.size(), 0);
+    std::string response = receiveHeader(clientSocket);
+    EXPECT_NE(response.find(" 200 "), std::string::npos);
+    EXPECT_TRUE(mockServer.waitForRequestCompleted(1, 1000));
+
+    // the keep-alive connection stays idle, so the server closes it after the timeout
+    struct timeval receiveTimeout{5, 0};
+    setsockopt(clientSocket, SOL_SOCKET, SO_RCVTIMEO, &receiveTimeout, sizeof(receiveTimeout));
+
+    const auto idleStart = std::chrono::steady_clock::now();
+    char data;
+    EXPECT_EQ(recv(clientSocket, &data, 1, 0), 0);
+    const auto idleDuration = std::chrono::steady_clock::now() - idleStart;
+    EXPECT_GE(idleDuration, std::chrono::milliseconds(500));
+    EXPECT_LT(idleDuration, std::chrono::seconds(5));
+    close(clientSocket);
+
+    EXPECT_TRUE(waitForOpenConnections(mockServer, 0, 1000));
+}
+
+static size_t CurlWriteStringCallback(void *contents, size_t size, size_t nmemb, void *userp)
+{
+    size_t realsize = size * nmemb;
+    static_cast<std::string *>(userp)->append(static_cast<char *>(contents), realsize);
+    return realsize;
+}
+
+TEST(HttpMockServer, ResponseTemplate)
+{
+    receiveBuffer.clear();
+    receiveHeaders.clear();
+    std::string url = "/template-url";
+
+    httpmock::HttpMockServer mockServer(port);
+    mockServer.setResponseTemplate("url={{url}} id={{header.X-Id}} page={{arg.page}} name={{form.name}} missing={{arg.missing}}",
+                                   {{"X-Echo-Id", "id-{{header.x-id}}"}});
+
+    mockServer.start();
+    EXPECT_TRUE(mockServer.isRunning());
+
+    CURL *curlHandle = curl_easy_init();
+    EXPECT_NE(curlHandle, nullptr);
+
+    std::string requestUrl = "http://127.0.0.1:" + std::to_string(port) + url + "?page=7";
+    curl_easy_setopt(curlHandle, CURLOPT_URL, requestUrl.c_str());
+    curl_easy_setopt(curlHandle, CURLOPT_POSTFIELDS, "name=daniel");
+    curl_easy_setopt(curlHandle, CURLOPT_WRITEFUNCTION, CurlWriteMemoryCallback);
+    curl_easy_setopt(curlHandle, CURLOPT_HEADERFUNCTION, CurlHeaderCallback);
+
+    struct curl_slist *headerList = NULL;
+    headerList = curl_slist_append(headerList, "X-Id: 4711");
+    curl_easy_setopt(curlHandle, CURLOPT_HTTPHEADER, headerList);
+
+    CURLcode returnCode = curl_easy_perform(curlHandle);
+    EXPECT_EQ(returnCode, CURLE_OK) << curl_easy_strerror(returnCode);
+
+    long httpResponseCode;
+    curl_easy_getinfo(curlHandle, CURLINFO_RESPONSE_CODE, &httpResponseCode);
+    curl_easy_cleanup(curlHandle);
+    curl_slist_free_all(headerList);
+    EXPECT_TRUE(mockServer.waitForRequestCompleted(1, 1000));
+
+    EXPECT_EQ(httpResponseCode, 200);
+    EXPECT_EQ(receiveBuffer, "url=" + url + " id=4711 page=7 name=daniel missing=");
+    EXPECT_EQ(receiveHeaders["X-Echo-Id"], "id-4711");
+
+    EXPECT_THROW(mockServer.setResponseTemplate("{{url"), std::invalid_argument);
+    EXPECT_THROW(mockServer.setResponseTemplate("{{cookie.session}}"), std::invalid_argument);
+
+    auto get = [&requestUrl](std::string &body, std::string &headers)
+    {
+        body.clear();
+        headers.clear();
+        CURL *curlHandle = curl_easy_init();
+        curl_easy_setopt(curlHandle, CURLOPT_URL, requestUrl.c_str());
+        curl_easy_setopt(curlHandle, CURLOPT_WRITEFUNCTION, CurlWriteStringCallback);
+        curl_easy_setopt(curlHandle, CURLOPT_WRITEDATA, &body);
+        curl_easy_setopt(curlHandle, CURLOPT_HEADERFUNCTION, CurlWriteStringCallback);
+        curl_easy_setopt(curlHandle, CURLOPT_HEADERDATA, &headers);
+        CURLcode returnCode = curl_easy_perform(curlHandle);
+        curl_easy_cleanup(curlHandle);
+        std::transform(headers.begin(), headers.end(), headers.begin(), [](unsigned char c) { return std::tolower(c); });
+        return returnCode;
+    };
+
+    auto countOf = [](const std::string &text, const std::string &pattern)
+    {
+        size_t count = 0;
+        for(size_t pos = text.find(pattern); pos != std::string::npos; pos = text.find(pattern, pos + 1))
+            ++count;
+        return count;
+    };
+
+    // a header of the callback replaces the header template of the same name (case-insensitive)
+    mockServer.setGenerateResponseCallback([](httpmock::ConnectionData *connectionData)
+    {
+        connectionData->responseHeader["x-echo-id"] = "override";
+    });
+
+    std::string body;
+    std::string headers;
+    EXPECT_EQ(get(body, headers), CURLE_OK);
+    EXPECT_TRUE(mockServer.waitForRequestCompleted(1, 1000));
+    EXPECT_EQ(countOf(headers, "x-echo-id:"), 1u);
+    EXPECT_EQ(countOf(headers, "x-echo-id: override"), 1u);
+
+    // a decoded line break of the request isn't rendered into a header: the response is sent with the stripped value
+    mockServer.setResponseTemplate("page={{arg.page}}", {{"X-Page", "{{arg.page}}"}});
+    requestUrl = "http://127.0.0.1:" + std::to_string(port) + url + "?page=a%0D%0Ab";
+    EXPECT_EQ(get(body, headers), CURLE_OK);
+    EXPECT_TRUE(mockServer.waitForRequestCompleted(1, 1000));
+    EXPECT_EQ(body, "page=a\r\nb");
+    EXPECT_EQ(countOf(headers, "x-page: ab\r\n"), 1u);
+
+    mockServer.setGenerateResponseCallback(nullptr);
+    mockServer.clearResponseTemplate();
+
+    EXPECT_EQ(get(body, headers), CURLE_OK);
+    EXPECT_TRUE(mockServer.waitForRequestCompleted(1, 1000));
+    EXPECT_EQ(body, "");
+    EXPECT_EQ(countOf(headers, "x-echo-id:"), 0u);
+}
+
+TEST(HttpMockServer, ConnectionDataClear)
+{
+    // a recycled object keeps the capacity of a usual request, but releases the one of a large upload or response
+    httpmock::ConnectionData connectionData;
+    connectionData.clear();
+    connectionData.responseBody.assign(1024, 'r');
+    connectionData.postData.resize(16 * 1024 * 1024);
+    connectionData.responseHeaderTemplateValues.assign(1, std::string(1024 * 1024, 'h'));
+
+    connectionData.clear();
+    EXPECT_TRUE(connectionData.responseBody.empty());
+    EXPECT_GE(connectionData.responseBody.capacity(), 1024u);
+    EXPECT_TRUE(connectionData.postData.empty());
+    EXPECT_LT(connectionData.postData.capacity(), 16u * 1024 * 1024);
+    ASSERT_EQ(connectionData.responseHeaderTemplateValues.size(), 1u);
+    EXPECT_LT(connectionData.responseHeaderTemplateValues[0].capacity(), 1024u * 1024);
+}
+
+TEST(HttpMockServer, HotSwapUnderLoad)
+{
+    std::string url = "/hot-swap-url";
+    const unsigned requestCount = 200;
+
+    // The template is published before the client starts, so every swap below is a single publication:
+    // a request sees either the callback or no callback, and then the rendered template.
+    httpmock::HttpMockServer mockServer(port);
+    mockServer.setResponseTemplate("template {{url}}");
+    mockServer.setGenerateResponseCallback([](httpmock::ConnectionData *connectionData)
+    {
+        connectionData->responseBody = "callback";
+    });
+
+    httpmock::ServerOptions options;
+    options.threadPoolSize = 4;
+    mockServer.start(options);
+    EXPECT_TRUE(mockServer.isRunning());
+
+    std::atomic<unsigned> invalidResponses{0};
+    std::thread client([&]
+    {
+        CURL *curlHandle = curl_easy_init();
+        std::string requestUrl = "http://127.0.0.1:" + std::to_string(port) + url;
+        std::string body;
+        curl_easy_setopt(curlHandle, CURLOPT_URL, requestUrl.c_str());
+        curl_easy_setopt(curlHandle, CURLOPT_WRITEFUNCTION, CurlWriteStringCallback);
+        curl_easy_setopt(curlHandle, CURLOPT_WRITEDATA, &body);
+
+        for(unsigned i=0; i<requestCount; ++i)
+        {
+            body.clear();
+            if((curl_easy_perform(curlHandle) != CURLE_OK) || ((body != "callback") && (body != "template " + url)))
+                invalidResponses++;
+        }
+
+        curl_easy_cleanup(curlHandle);
+    });
+
+    // swap the behaviour while the client is running
+    for(unsigned i=0; i<50; ++i)
+    {
+        if(i % 2)
+            mockServer.setGenerateResponseCallback([](httpmock::ConnectionData *connectionData)
+            {
+                connectionData->responseBody = "callback";
+            });
+        else
+            mockServer.setGenerateResponseCallback(nullptr);
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    client.join();
+    EXPECT_EQ(invalidResponses, 0);
+
+    // a new request sees the last configuration immediately
+    mockServer.setGenerateResponseCallback([](httpmock::ConnectionData *connectionData)
+    {
+        connectionData->responseBody = "final";
+    });
+
+    CURL *curlHandle = curl_easy_init();
+    std::string requestUrl = "http://127.0.0.1:" + std::to_string(port) + url;
+    std::string body;
+    curl_easy_setopt(curlHandle, CURLOPT_URL, requestUrl.c_str());
+    curl_easy_setopt(curlHandle, CURLOPT_WRITEFUNCTION, CurlWriteStringCallback);
+    curl_easy_setopt(curlHandle, CURLOPT_WRITEDATA, &body);
+    CURLcode returnCode = curl_easy_perform(curlHandle);
+    EXPECT_EQ(returnCode, CURLE_OK) << curl_easy_strerror(returnCode);
+    curl_easy_cleanup(curlHandle);
+
+    EXPECT_EQ(body, "final");
+}
+
+TEST(HttpMockServer, HotSwapInFlight)
+{
+    std::string requestUrl = "http://127.0.0.1:" + std::to_string(port) + "/in-flight-url";
+
+    std::promise<void> callbackEntered;
+    std::promise<void> swapDone;
+    std::shared_future<void> swapDoneFuture = swapDone.get_future().share();
+
+    httpmock::HttpMockServer mockServer(port);
+    mockServer.setGenerateResponseCallback([&callbackEntered, swapDoneFuture](httpmock::ConnectionData *connectionData)
+    {
+        callbackEntered.set_value();
+        swapDoneFuture.wait();
+        connectionData->responseBody = "old";
+    });
+
+    mockServer.start();
+    EXPECT_TRUE(mockServer.isRunning());
+
+    auto get = [&requestUrl]
+    {
+        CURL *curlHandle = curl_easy_init();
+        std::string body;
+        curl_easy_setopt(curlHandle, CURLOPT_URL, requestUrl.c_str());
+        curl_easy_setopt(curlHandle, CURLOPT_WRITEFUNCTION, CurlWriteStringCallback);
+        curl_easy_setopt(curlHandle, CURLOPT_WRITEDATA, &body);
+        CURLcode returnCode = curl_easy_perform(curlHandle);
+        EXPECT_EQ(returnCode, CURLE_OK) << curl_easy_strerror(returnCode);
+        curl_easy_cleanup(curlHandle);
+        return body;
+    };
+
+    std::string inFlightBody;
+    std::thread client([&] { inFlightBody = get(); });
+
+    // the old callback is running, when the new one is published; the request must complete with the old one
+    ASSERT_EQ(callbackEntered.get_future().wait_for(std::chrono::seconds(5)), std::future_status::ready);
+    mockServer.setGenerateResponseCallback([](httpmock::ConnectionData *connectionData)
+    {
+        connectionData->responseBody = "new";
+    });
+    swapDone.set_value();
+    client.join();
+
+    EXPECT_EQ(inFlightBody, "old");
+    EXPECT_TRUE(mockServer.waitForRequestCompleted(1, 1000));
+    EXPECT_EQ(get(), "new");
+}
+
+// flags: FIN (0x80) and the reserved bits
+static std::string maskedClientFrame(uint8_t opcode, const std::string &payload, uint8_t flags = 0x80)
+{
+    const uint8_t maskingKey[4] = {0x12, 0x34, 0x56, 0x78};
+
+    std::string frame;
+    frame.push_back(static_cast<char>(flags | opcode));
+    frame.push_back(static_cast<char>(0x80 | payload.size())); // payload < 126 bytes
+    frame.append(reinterpret_cast<const char *>(maskingKey), sizeof(maskingKey));
+    for(size_t i=0; i<payload.size(); ++i)
+        frame.push_back(static_cast<char>(payload[i] ^ maskingKey[i % 4]));
+
+    return frame;
+}
+
+TEST(HttpMockServer, WebSocket)
+{
+    std::string url = "/websocket-url";
+    const size_t burstCount = 1000;
+
+    httpmock::HttpMockServer mockServer(port);
+    mockServer.setWebSocketMessageCallback([](httpmock::WebSocketSession &session, httpmock::WebSocketOpcode opcode, const std::byte *data, size_t size)
+    {
+        if(opcode == httpmock::WebSocketOpcode::Text)
+            session.sendText("echo " + std::string(reinterpret_cast<const char *>(data), size));
+    });
+
+    httpmock::ServerOptions options;
+    options.allowWebSocket = true;
+    mockServer.start(options);
+    EXPECT_TRUE(mockServer.isRunning());
+
+    int clientSocket = connectedSocket(port);
+    ASSERT_GE(clientSocket, 0);
+
+    std::string request = "GET " + url + " HTTP/1.1\r\nHost: 127.0.0.1\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                          "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n";
+    send(clientSocket, request.data(), request.size(), 0);
+
+    std::string response = receiveHeader(clientSocket);
+    EXPECT_NE(response.find(" 101 "), std::string::npos);
+    EXPECT_NE(response.find("s3pPLMBiTxaQ9kYGzzhZRbK+xOo="), std::string::npos); // example of RFC 6455
+
+    ASSERT_TRUE(mockServer.waitForWebSocketSessions(1, 1000));
+    EXPECT_EQ(mockServer.webSocketSessions().front()->url(), url);
+
+    std::string frame = maskedClientFrame(0x1, "hello");
+    send(clientSocket, frame.data(), frame.size(), 0);
+    EXPECT_EQ(receiveExactly(clientSocket, 2 + 10), std::string("\x81\x0a" "echo hello", 12));
+
+    // server initiated burst of a preallocated frame
+    httpmock::WebSocketFrame burstFrame(std::string("tick"));
+    EXPECT_EQ(mockServer.broadcast(burstFrame, burstCount), 1);
+    std::string burst = receiveExactly(clientSocket, burstCount * burstFrame.encoded().size());
+    EXPECT_EQ(burst.size(), burstCount * burstFrame.encoded().size());
+    EXPECT_EQ(burst.substr(0, 6), std::string("\x81\x04" "tick", 6));
+
+    auto session = mockServer.webSocketSessions().front();
+    EXPECT_EQ(session->receivedFrames(), 1);
+    EXPECT_EQ(session->receivedBytes(), 5);
+    EXPECT_EQ(session->sentFrames(), 1 + burstCount);
+    EXPECT_EQ(session->sentBytes(), 10 + burstCount * 4);
+
+    // close handshake initiated by the client
+    frame = maskedClientFrame(0x8, std::string("\x03\xe8", 2));
+    send(clientSocket, frame.data(), frame.size(), 0);
+    EXPECT_EQ(receiveExactly(clientSocket, 4), std::string("\x88\x02\x03\xe8", 4));
+    close(clientSocket);
+
+    mockServer.stop();
+    EXPECT_FALSE(session->isOpen());
+}
+
+static int upgradedSocket(const std::string &url)
+{
+    int clientSocket = connectedSocket(port);
+    if(clientSocket < 0)
+        return -1;
+
+    std::string request = "GET " + url + " HTTP/1.1\r\nHost: 127.0.0.1\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                          "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n";
+    send(clientSocket, request.data(), request.size(), 0);
+    if(receiveHeader(clientSocket).find(" 101 ") == std::string::npos)
+    {
+        close(clientSocket);
+        return -1;
+    }
+
+    return clientSocket;
+}
+
+static bool waitForNoWebSocketSessions(httpmock::HttpMockServer &mockServer, uint32_t timeoutMs)
+{
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    while(!mockServer.webSocketSessions().empty())
+    {
+        if(std::chrono::steady_clock::now() >= deadline)
+            return false;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    return true;
+}
+
+TEST(HttpMockServer, WebSocketProtocolErrors)
+{
+    const std::string protocolErrorClose("\x88\x02\x03\xea", 4); // 1002
+
+    httpmock::HttpMockServer mockServer(port);
+    httpmock::ServerOptions options;
+    options.allowWebSocket = true;
+    mockServer.start(options);
+    EXPECT_TRUE(mockServer.isRunning());
+
+    const std::vector<std::pair<std::string, std::string>> violations =
+    {
+        {"reserved bit",            maskedClientFrame(0x1, "x", 0x80 | 0x40)},
+        {"fragmented ping",         maskedClientFrame(0x9, "x", 0x00)},
+        {"ping longer than 125",    maskedClientFrame(0x9, std::string(126, 'p'))},
+        {"orphan continuation",     maskedClientFrame(0x0, "x")},
+        {"text within fragments",   maskedClientFrame(0x1, "a", 0x00) + maskedClientFrame(0x1, "b")},
+        {"close with 1 byte",       maskedClientFrame(0x8, "x")},
+        {"reserved opcode",         maskedClientFrame(0x3, "x")}
+    };
+
+    for(auto &violation : violations)
+    {
+        int clientSocket = upgradedSocket("/protocol-error-url");
+        ASSERT_GE(clientSocket, 0);
+
+        send(clientSocket, violation.second.data(), violation.second.size(), 0);
+        EXPECT_EQ(receiveExactly(clientSocket, 4), protocolErrorClose) << violation.first;
+        EXPECT_EQ(receiveExactly(clientSocket, 1), "") << violation.first; // the server closes the connection
+        close(clientSocket);
+    }
+
+    // closed sessions are dropped
+    EXPECT_TRUE(waitForNoWebSocketSessions(mockServer, 1000));
+}
+
+TEST(HttpMockServer, WebSocketStalledPeer)
+{
+    httpmock::HttpMockServer mockServer(port);
+    httpmock::ServerOptions options;
+    options.allowWebSocket = true;
+    options.webSocketSendTimeoutMs = 200;
+    mockServer.start(options);
+    EXPECT_TRUE(mockServer.isRunning());
+
+    // the client never reads
+    int clientSocket = upgradedSocket("/stalled-url");
+    ASSERT_GE(clientSocket, 0);
+    ASSERT_TRUE(mockServer.waitForWebSocketSessions(1, 1000));
+    auto session = mockServer.webSocketSessions().front();
+
+    // far more than the socket buffers can take: the send gives up after the timeout and disconnects the peer
+    httpmock::WebSocketFrame frame(std::string(60000, 'x'));
+    const auto broadcastStart = std::chrono::steady_clock::now();
+    EXPECT_EQ(mockServer.broadcast(frame, 1000), 0);
+    EXPECT_LT(std::chrono::steady_clock::now() - broadcastStart, std::chrono::seconds(5));
+    EXPECT_FALSE(session->isOpen());
+
+    EXPECT_TRUE(waitForNoWebSocketSessions(mockServer, 1000));
+    EXPECT_EQ(mockServer.broadcast(frame, 1), 0);
+
+    close(clientSocket);
+    mockServer.stop();
+}
+
+TEST(HttpMockServer, WebSocketCallbackSendTimeout)
+{
+    httpmock::HttpMockServer mockServer(port);
+    std::promise<std::pair<bool, size_t>> callbackResult;
+
+    // The own send of the callback times out and closes the session. The broadcast afterwards must not release the
+    // closed session on its read thread, which would then have to wait for itself.
+    mockServer.setWebSocketMessageCallback([&mockServer, &callbackResult](httpmock::WebSocketSession &session, httpmock::WebSocketOpcode, const std::byte *, size_t)
+    {
+        const std::string payload(32 * 1024 * 1024, 'x');
+        bool sent = session.sendBinary(payload.data(), payload.size());
+        size_t reached = mockServer.broadcast(httpmock::WebSocketFrame(std::string("late")));
+        callbackResult.set_value({sent, reached});
+    });
+
+    httpmock::ServerOptions options;
+    options.allowWebSocket = true;
+    options.webSocketSendTimeoutMs = 200;
+    mockServer.start(options);
+    EXPECT_TRUE(mockServer.isRunning());
+
+    // the client sends one message, but never reads
+    int clientSocket = upgradedSocket("/callback-timeout-url");
+    ASSERT_GE(clientSocket, 0);
+    ASSERT_TRUE(mockServer.waitForWebSocketSessions(1, 1000));
+
+    std::string frame = maskedClientFrame(0x1, "flood");
+    send(clientSocket, frame.data(), frame.size(), 0);
+
+    std::future<std::pair<bool, size_t>> result = callbackResult.get_future();
+    ASSERT_EQ(result.wait_for(std::chrono::seconds(5)), std::future_status::ready);
+    EXPECT_EQ(result.get(), std::make_pair(false, size_t(0)));
+    EXPECT_TRUE(waitForNoWebSocketSessions(mockServer, 1000));
+
+    close(clientSocket);
+    mockServer.stop();
+}
+
+TEST(HttpMockServer, RequestPhasesTrace)
+{
+    std::string url = "/trace-url";
+    const unsigned requestCount = 3;
+
+    httpmock::HttpMockServer mockServer(port);
+    mockServer.setGenerateResponseCallback([](httpmock::ConnectionData *connectionData)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        connectionData->responseBody = "traced";
+    });
+
+    httpmock::ServerOptions options;
+    options.traceBufferSize = 16;
+    mockServer.start(options);
+    EXPECT_TRUE(mockServer.isRunning());
+
+    CURL *curlHandle = curl_easy_init();
+    EXPECT_NE(curlHandle, nullptr);
+
+    std::string requestUrl = "http://127.0.0.1:" + std::to_string(port) + url;
+    curl_easy_setopt(curlHandle, CURLOPT_URL, requestUrl.c_str());
+    curl_easy_setopt(curlHandle, CURLOPT_WRITEFUNCTION, CurlWriteMemoryCallback);
+    for(unsigned i=0; i<requestCount; ++i)
+    {
+        CURLcode returnCode = curl_easy_perform(curlHandle);
+        EXPECT_EQ(returnCode, CURLE_OK) << curl_easy_strerror(returnCode);
+        EXPECT_TRUE(mockServer.waitForRequestCompleted(1, 1000));
+    }
+    curl_easy_cleanup(curlHandle);
+
+    const httpmock::RequestPhases &phases = mockServer.lastConnectionData()->phases;
+    EXPECT_LE(phases.firstCallback,   phases.uploadCompleted);
+    EXPECT_LE(phases.uploadCompleted, phases.callbackEntered);
+    EXPECT_GE(phases.callbackExited - phases.callbackEntered, std::chrono::milliseconds(2));
+    EXPECT_LE(phases.callbackExited,  phases.responseQueued);
+    EXPECT_LE(phases.responseQueued,  phases.requestCompleted);
+
+    std::ostringstream trace;
+    mockServer.writeChromeTrace(trace);
+    const std::string json = trace.str();
+    EXPECT_EQ(json.rfind("{\"traceEvents\":[", 0), 0);
+
+    // one event for the whole request plus four phases
+    size_t eventCount = 0;
+    for(size_t position = json.find("\"ph\":\"X\""); position != std::string::npos; position = json.find("\"ph\":\"X\"", position + 1))
+        eventCount++;
+    EXPECT_EQ(eventCount, requestCount * 5);
+    EXPECT_NE(json.find("\"name\":\"callback\""), std::string::npos);
+    EXPECT_NE(json.find("\"url\":\"" + url + "\""), std::string::npos);
+}
+
+TEST(HttpMockServer, ResponseBodyViewOnAnyPort)
+{
+    std::string url = "/body-view-url";
+    static const char cannedBody[] = "canned response";
+    std::string body;
+
+    httpmock::HttpMockServer mockServer(0);
+    mockServer.setGenerateResponseCallback([](httpmock::ConnectionData *connectionData)
+    {
+        connectionData->responseBody = "ignored";
+        connectionData->responseBodyView = cannedBody;
+    });
+
+    mockServer.start();
+    EXPECT_TRUE(mockServer.isRunning());
+    EXPECT_NE(mockServer.port(), 0);
+
+    CURL *curlHandle = curl_easy_init();
+    EXPECT_NE(curlHandle, nullptr);
+
+    std::string requestUrl = "http://127.0.0.1:" + std::to_string(mockServer.port()) + url;
+    curl_easy_setopt(curlHandle, CURLOPT_URL, requestUrl.c_str());
+    curl_easy_setopt(curlHandle, CURLOPT_WRITEFUNCTION, CurlWriteStringCallback);
+    curl_easy_setopt(curlHandle, CURLOPT_WRITEDATA, &body);
+
+    CURLcode returnCode = curl_easy_perform(curlHandle);
+    EXPECT_EQ(returnCode, CURLE_OK) << curl_easy_strerror(returnCode);
+    curl_easy_cleanup(curlHandle);
+    EXPECT_TRUE(mockServer.waitForRequestCompleted(1, 1000));
+
+    EXPECT_EQ(body, cannedBody);
+
+    // the previous port is taken meanwhile: a restart chooses another free port instead of rebinding it
+    const int previousPort = mockServer.port();
+    mockServer.stop();
+    EXPECT_EQ(mockServer.port(), 0);
+
+    // SO_REUSEADDR: a connection of the first run may still be in TIME_WAIT; the listening socket blocks the port anyway
+    int blockingSocket = socket(AF_INET, SOCK_STREAM, 0);
+    ASSERT_GE(blockingSocket, 0);
+    int enable = 1;
+    setsockopt(blockingSocket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+    struct sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(static_cast<uint16_t>(previousPort));
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    ASSERT_EQ(bind(blockingSocket, reinterpret_cast<struct sockaddr *>(&address), sizeof(address)), 0);
+    ASSERT_EQ(listen(blockingSocket, 1), 0);
+
+    EXPECT_NO_THROW(mockServer.start());
+    EXPECT_NE(mockServer.port(), 0);
+    EXPECT_NE(mockServer.port(), previousPort);
+    close(blockingSocket);
+}
+
+TEST(HttpMockServer, KeepAliveAccounting)
+{
+    std::string url = "/keep-alive-url";
+    const unsigned requestCount = 10;
+    std::string body;
+
+    httpmock::HttpMockServer mockServer(port);
+    mockServer.setGenerateResponseCallback([](httpmock::ConnectionData *connectionData)
+    {
+        connectionData->responseBody = "pooled";
+    });
+
+    mockServer.start();
+    EXPECT_TRUE(mockServer.isRunning());
+
+    std::string requestUrl = "http://127.0.0.1:" + std::to_string(port) + url;
+
+    // the easy handle keeps the connection open between the requests
+    CURL *curlHandle = curl_easy_init();
+    EXPECT_NE(curlHandle, nullptr);
+    curl_easy_setopt(curlHandle, CURLOPT_URL, requestUrl.c_str());
+    curl_easy_setopt(curlHandle, CURLOPT_WRITEFUNCTION, CurlWriteStringCallback);
+    curl_easy_setopt(curlHandle, CURLOPT_WRITEDATA, &body);
+    for(unsigned i=0; i<requestCount; ++i)
+    {
+        CURLcode returnCode = curl_easy_perform(curlHandle);
+        EXPECT_EQ(returnCode, CURLE_OK) << curl_easy_strerror(returnCode);
+        EXPECT_TRUE(mockServer.waitForRequestCompleted(1, 1000));
+    }
+
+    const uint64_t pooledConnectionId = mockServer.lastConnectionData()->connectionId;
+    EXPECT_NE(pooledConnectionId, 0);
+    EXPECT_EQ(mockServer.lastConnectionData()->requestIndexOnConnection, requestCount - 1);
+    curl_easy_cleanup(curlHandle);
+
+    // a second handle opens a second connection
+    curlHandle = curl_easy_init();
+    curl_easy_setopt(curlHandle, CURLOPT_URL, requestUrl.c_str());
+    curl_easy_setopt(curlHandle, CURLOPT_WRITEFUNCTION, CurlWriteStringCallback);
+    curl_easy_setopt(curlHandle, CURLOPT_WRITEDATA, &body);
+    CURLcode returnCode = curl_easy_perform(curlHandle);
+    EXPECT_EQ(returnCode, CURLE_OK) << curl_easy_strerror(returnCode);
+    curl_easy_cleanup(curlHandle);
+    EXPECT_TRUE(mockServer.waitForRequestCompleted(1, 1000));
+
+    EXPECT_NE(mockServer.lastConnectionData()->connectionId, pooledConnectionId);
+    EXPECT_EQ(mockServer.lastConnectionData()->requestIndexOnConnection, 0);
+
+    // an idle connection without any request doesn't change the reuse ratio
+    int idleSocket = connectedSocket(port);
+    ASSERT_GE(idleSocket, 0);
+    EXPECT_TRUE(waitForOpenConnections(mockServer, 1, 1000));
+
+    httpmock::ConnectionStatistics statistics = mockServer.connectionStatistics();
+    EXPECT_EQ(statistics.connections, 3);
+    EXPECT_EQ(statistics.requests, requestCount + 1);
+    EXPECT_EQ(statistics.reusedRequests, requestCount - 1);
+    EXPECT_EQ(statistics.maxRequestsPerConnection, requestCount);
+    EXPECT_DOUBLE_EQ(statistics.reuseRatio(), double(requestCount - 1) / double(requestCount + 1));
+    close(idleSocket);
+
+    for(auto &record : mockServer.connectionRecords())
+    {
+        if(record.connectionId == pooledConnectionId)
+        {
+            EXPECT_EQ(record.sentBytes, requestCount * std::string("pooled").size());
+        }
+    }
+}
+
+TEST(HttpMockServer, PipelinedRequests)
+{
+    const unsigned requestCount = 3;
+
+    std::mutex indicesMutex;
+    std::vector<uint64_t> requestIndices;
+
+    httpmock::HttpMockServer mockServer(port);
+    mockServer.setGenerateResponseCallback([&](httpmock::ConnectionData *connectionData)
+    {
+        std::lock_guard<std::mutex> lock(indicesMutex);
+        requestIndices.push_back(connectionData->requestIndexOnConnection);
+        connectionData->responseBody = "piped";
+    });
+
+    mockServer.start();
+    EXPECT_TRUE(mockServer.isRunning());
+
+    // all requests in one write, before the first response has been read
+    int clientSocket = connectedSocket(port);
+    ASSERT_GE(clientSocket, 0);
+    std::string requests;
+    for(unsigned i=0; i<requestCount; ++i)
+        requests += "GET /pipelined-url" + std::to_string(i) + " HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n";
+    send(clientSocket, requests.data(), requests.size(), 0);
+
+    for(unsigned i=0; i<requestCount; ++i)
+    {
+        EXPECT_NE(receiveHeader(clientSocket).find(" 200 "), std::string::npos);
+        EXPECT_EQ(receiveExactly(clientSocket, 5), "piped");
+    }
+    close(clientSocket);
+
+    // the completion of the last response may still be pending
+    for(unsigned i=0; (i < 1000) && (mockServer.completedRequestCount() < requestCount); ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    EXPECT_EQ(mockServer.completedRequestCount(), requestCount);
+    EXPECT_EQ(mockServer.lastConnectionData()->url, "/pipelined-url" + std::to_string(requestCount - 1));
+
+    {
+        std::lock_guard<std::mutex> lock(indicesMutex);
+        EXPECT_EQ(requestIndices, std::vector<uint64_t>({0, 1, 2}));
+    }
+
+    std::vector<httpmock::ConnectionRecord> records = mockServer.connectionRecords();
+    ASSERT_EQ(records.size(), 1);
+    EXPECT_EQ(records.front().requestCount, requestCount);
+    EXPECT_EQ(records.front().sentBytes, requestCount * std::string("piped").size());
+}
+
+TEST(HttpMockServer, Sharded)
+{
+    std::string url = "/sharded-url";
+    const unsigned requestCount = 40;
+
+    httpmock::ShardedHttpMockServer mockServer(port, 4);
+    mockServer.setGenerateResponseCallback([](httpmock::ConnectionData *connectionData)
+    {
+        connectionData->responseBody = "shard";
+    });
+
+    // set on the pre-created listen sockets, as libmicrohttpd doesn't for MHD_OPTION_LISTEN_SOCKET
+    httpmock::ServerOptions options;
+    options.tcpFastOpen = true;
+    mockServer.start(options);
+    EXPECT_TRUE(mockServer.isRunning());
+    EXPECT_EQ(mockServer.shardCount(), 4);
+
+    for(unsigned i=0; i<requestCount; ++i)
+    {
+        // a new handle per request: every request opens a new connection which the kernel may assign to another shard
+        CURL *curlHandle = curl_easy_init();
+        EXPECT_NE(curlHandle, nullptr);
+
+        std::string requestUrl = "http://127.0.0.1:" + std::to_string(port) + url + std::to_string(i);
+        curl_easy_setopt(curlHandle, CURLOPT_URL, requestUrl.c_str());
+        curl_easy_setopt(curlHandle, CURLOPT_WRITEFUNCTION, CurlWriteMemoryCallback);
+
+        CURLcode returnCode = curl_easy_perform(curlHandle);
+        EXPECT_EQ(returnCode, CURLE_OK) << curl_easy_strerror(returnCode);
+        curl_easy_cleanup(curlHandle);
+    }
+
+    EXPECT_TRUE(mockServer.waitForRequestCompleted(requestCount, 1000));
+    EXPECT_EQ(mockServer.completedRequestCount(), requestCount);
+    EXPECT_TRUE(mockServer.lastConnectionData()->url == url + std::to_string(requestCount - 1));
+
+    // SO_REUSEPORT hashes the source port of every new connection: with 40 connections all of them hit the same shard
+    // with a probability of 4 * (1/4)^40
+    unsigned busyShards = 0;
+    for(unsigned i=0; i<mockServer.shardCount(); ++i)
+    {
+        if(mockServer.shard(i).completedRequestCount() > 0)
+            ++busyShards;
+    }
+    EXPECT_GE(busyShards, 2u);
+}
+
+TEST(HttpMockServer, ShardedWebSocket)
+{
+    const size_t sessionCount = 8;
+
+    httpmock::ShardedHttpMockServer mockServer(port, 4);
+    mockServer.setWebSocketMessageCallback([](httpmock::WebSocketSession &session, httpmock::WebSocketOpcode opcode, const std::byte *data, size_t size)
+    {
+        if(opcode == httpmock::WebSocketOpcode::Text)
+            session.sendText("echo " + std::string(reinterpret_cast<const char *>(data), size));
+    });
+
+    httpmock::ServerOptions options;
+    options.allowWebSocket = true;
+    mockServer.start(options);
+    EXPECT_TRUE(mockServer.isRunning());
+
+    std::vector<int> clientSockets;
+    for(size_t i=0; i<sessionCount; ++i)
+    {
+        int clientSocket = upgradedSocket("/sharded-websocket-url");
+        ASSERT_GE(clientSocket, 0);
+        clientSockets.push_back(clientSocket);
+    }
+
+    // the sessions are spread over the shards, but merged here
+    ASSERT_TRUE(mockServer.waitForWebSocketSessions(sessionCount, 1000));
+    EXPECT_EQ(mockServer.webSocketSessions().size(), sessionCount);
+
+    std::string frame = maskedClientFrame(0x1, "hello");
+    for(int clientSocket : clientSockets)
+    {
+        send(clientSocket, frame.data(), frame.size(), 0);
+        EXPECT_EQ(receiveExactly(clientSocket, 2 + 10), std::string("\x81\x0a" "echo hello", 12));
+    }
+
+    httpmock::WebSocketFrame tickFrame(std::string("tick"));
+    EXPECT_EQ(mockServer.broadcast(tickFrame), sessionCount);
+    for(int clientSocket : clientSockets)
+    {
+        EXPECT_EQ(receiveExactly(clientSocket, 6), std::string("\x81\x04" "tick", 6));
+        close(clientSocket);
+    }
+
+    mockServer.stop();
+}
+
 int main(int argc, char *argv[])
 {
     curl_global_init(CURL_GLOBAL_ALL);
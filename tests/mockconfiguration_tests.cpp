@@ -0,0 +1,243 @@
+#include "httpmockserver/mockconfiguration.hpp"
+
+#include <string>
+#include <fstream>
+#include <filesystem>
+#include <future>
+#include <thread>
+
+#include <gmock/gmock.h>
+#include <curl/curl.h>
+
+#include <unistd.h>
+
+namespace
+{
+
+std::string writeFile(const std::string &name, const std::string &content)
+{
+    std::filesystem::path path = std::filesystem::temp_directory_path() / ("httpmockserver-" + std::to_string(::getpid()) + "-" + name);
+    std::ofstream(path, std::ios::binary) << content;
+    return path.string();
+}
+
+size_t CurlAppendCallback(void *contents, size_t size, size_t nmemb, void *userp)
+{
+    size_t realsize = size * nmemb;
+    static_cast<std::string *>(userp)->append(static_cast<char *>(contents), realsize);
+    return realsize;
+}
+
+struct Response
+{
+    long code{0};
+    std::string body;
+    std::string header;
+};
+
+Response request(int port, const std::string &url, const char *postFields = nullptr)
+{
+    Response response;
+    CURL *curlHandle = curl_easy_init();
+    std::string requestUrl = "http://127.0.0.1:" + std::to_string(port) + url;
+    curl_easy_setopt(curlHandle, CURLOPT_URL, requestUrl.c_str());
+    curl_easy_setopt(curlHandle, CURLOPT_WRITEFUNCTION, CurlAppendCallback);
+    curl_easy_setopt(curlHandle, CURLOPT_WRITEDATA, &response.body);
+    curl_easy_setopt(curlHandle, CURLOPT_HEADERFUNCTION, CurlAppendCallback);
+    curl_easy_setopt(curlHandle, CURLOPT_HEADERDATA, &response.header);
+    if(postFields)
+        curl_easy_setopt(curlHandle, CURLOPT_POSTFIELDS, postFields);
+
+    CURLcode returnCode = curl_easy_perform(curlHandle);
+    EXPECT_EQ(returnCode, CURLE_OK) << curl_easy_strerror(returnCode);
+    curl_easy_getinfo(curlHandle, CURLINFO_RESPONSE_CODE, &response.code);
+    curl_easy_cleanup(curlHandle);
+    return response;
+}
+
+std::string loadError(const std::string &name, const std::string &content)
+{
+    std::string fileName = writeFile(name, content);
+    try
+    {
+        httpmock::MockConfiguration::load(fileName);
+    }
+    catch(const std::runtime_error &exception)
+    {
+        std::filesystem::remove(fileName);
+        return exception.what();
+    }
+
+    std::filesystem::remove(fileName);
+    return std::string();
+}
+
+}
+
+TEST(MockConfiguration, Parse)
+{
+    std::string fileName = writeFile("parse.conf",
+        "# comment\n"
+        "   # indented comment\n"
+        "\n"
+        "port 0\n"
+        "shards 2\n"
+        "connection-limit 100\n"
+        "connection-timeout 30\n"
+        "post-buffer-size 4096\n"
+        "turbo\n"
+        "route GET /color#anchor 200 text/css inline body { color: #fff; }\n"
+        "header X-Fragment contains # too\n");
+
+    std::shared_ptr<const httpmock::MockConfiguration> configuration = httpmock::MockConfiguration::load(fileName);
+    std::filesystem::remove(fileName);
+
+    EXPECT_EQ(configuration->port, 0);
+    EXPECT_TRUE(configuration->sharded);
+    EXPECT_EQ(configuration->shardCount, 2);
+    EXPECT_EQ(configuration->options.connectionLimit, 100);
+    EXPECT_EQ(configuration->options.connectionTimeoutSec, 30);
+    EXPECT_EQ(configuration->options.postProcessorBufferSize, 4096);
+    EXPECT_TRUE(configuration->options.turbo);
+    EXPECT_EQ(configuration->routeCount(), 1);
+
+    httpmock::ConnectionData connectionData;
+    connectionData.clear();
+    connectionData.url = "/color#anchor";
+    configuration->generateResponse(configuration, &connectionData);
+    EXPECT_EQ(connectionData.responseCode, 200);
+    EXPECT_EQ(connectionData.responseBodyView, "body { color: #fff; }");
+    EXPECT_EQ(connectionData.responseHeader["X-Fragment"], "contains # too");
+}
+
+TEST(MockConfiguration, ParseErrors)
+{
+    EXPECT_THAT(loadError("unknown.conf", "port 8080\n\nlisten 80\n"), ::testing::HasSubstr("unknown.conf:3: unknown directive 'listen'"));
+    EXPECT_THAT(loadError("number.conf", "threads four\n"), ::testing::HasSubstr("number.conf:1: missing or invalid number for 'threads'"));
+    EXPECT_THAT(loadError("header.conf", "# no route yet\nheader X-Test 1\n"), ::testing::HasSubstr("header.conf:2: header without route"));
+    EXPECT_THAT(loadError("method.conf", "route PUT /a 200 text/plain inline a\n"), ::testing::HasSubstr("method.conf:1: unsupported method 'PUT'"));
+    EXPECT_THAT(loadError("kind.conf", "route GET /a 200 text/plain base64 YQ==\n"), ::testing::HasSubstr("kind.conf:1: unknown body kind 'base64'"));
+    EXPECT_THAT(loadError("template.conf", "route GET /a 200 text/plain template {{url\n"), ::testing::HasSubstr("template.conf:1: "));
+    EXPECT_THAT(loadError("file.conf", "\nroute GET /a 200 text/plain file /nonexistent/body\n"), ::testing::HasSubstr("file.conf:2: can't open '/nonexistent/body'"));
+
+    EXPECT_THROW(httpmock::MockConfiguration::load("/nonexistent/httpmockserver.conf"), std::runtime_error);
+}
+
+TEST(MockConfiguration, Routing)
+{
+    const std::string fileBody(100000, 'f');
+    std::string bodyFileName = writeFile("body.bin", fileBody);
+    std::string fileName = writeFile("routing.conf",
+        "route GET  /exact    200 text/plain inline exact\n"
+        "header X-Route exact route\n"
+        "route POST /exact    201 text/plain template posted {{form.name}}\n"
+        "route GET  /file     200 application/octet-stream file " + bodyFileName + "\n"
+        "route GET  *         404 text/plain inline fallback\n");
+
+    std::shared_ptr<const httpmock::MockConfiguration> configuration = httpmock::MockConfiguration::load(fileName);
+    std::filesystem::remove(fileName);
+    // the file is mapped: it isn't needed anymore after loading
+    std::filesystem::remove(bodyFileName);
+
+    httpmock::HttpMockServer mockServer(0);
+    mockServer.setGenerateResponseCallback(httpmock::MockConfiguration::responseCallback(configuration));
+    mockServer.start();
+    ASSERT_TRUE(mockServer.isRunning());
+
+    Response response = request(mockServer.port(), "/exact");
+    EXPECT_EQ(response.code, 200);
+    EXPECT_EQ(response.body, "exact");
+    EXPECT_THAT(response.header, ::testing::HasSubstr("X-Route: exact route"));
+    EXPECT_THAT(response.header, ::testing::HasSubstr("Content-Type: text/plain"));
+
+    response = request(mockServer.port(), "/exact", "name=daniel");
+    EXPECT_EQ(response.code, 201);
+    EXPECT_EQ(response.body, "posted daniel");
+
+    response = request(mockServer.port(), "/file");
+    EXPECT_EQ(response.code, 200);
+    EXPECT_EQ(response.body, fileBody);
+
+    // "*" catches unknown urls, but only for its method
+    response = request(mockServer.port(), "/unknown");
+    EXPECT_EQ(response.code, 404);
+    EXPECT_EQ(response.body, "fallback");
+
+    response = request(mockServer.port(), "/unknown", "name=daniel");
+    EXPECT_EQ(response.code, 404);
+    EXPECT_EQ(response.body, "");
+}
+
+TEST(MockConfiguration, ReloadWhileRequestInFlight)
+{
+    // large enough, that the transfer is still running while the configuration is replaced
+    const std::string oldBody(16 * 1024 * 1024, 'o');
+    std::string bodyFileName = writeFile("old.bin", oldBody);
+    std::string oldFileName = writeFile("old.conf", "route GET /data 200 application/octet-stream file " + bodyFileName + "\n");
+    std::string newFileName = writeFile("new.conf", "route GET /data 200 text/plain inline new\n");
+
+    std::shared_ptr<const httpmock::MockConfiguration> configuration = httpmock::MockConfiguration::load(oldFileName);
+    std::weak_ptr<const httpmock::MockConfiguration> oldConfiguration = configuration;
+
+    httpmock::HttpMockServer mockServer(0);
+    mockServer.setGenerateResponseCallback(httpmock::MockConfiguration::responseCallback(configuration));
+    mockServer.start();
+    ASSERT_TRUE(mockServer.isRunning());
+
+    // the client stops reading after the first chunk until the reload is done
+    struct Transfer
+    {
+        std::string body;
+        std::promise<void> started;
+        std::shared_future<void> reloaded;
+    } transfer;
+
+    std::promise<void> reloaded;
+    transfer.reloaded = reloaded.get_future().share();
+
+    std::thread client([&]
+    {
+        CURL *curlHandle = curl_easy_init();
+        std::string requestUrl = "http://127.0.0.1:" + std::to_string(mockServer.port()) + "/data";
+        curl_easy_setopt(curlHandle, CURLOPT_URL, requestUrl.c_str());
+        curl_easy_setopt(curlHandle, CURLOPT_WRITEFUNCTION, +[](void *contents, size_t size, size_t nmemb, void *userp) -> size_t
+        {
+            Transfer *transfer = static_cast<Transfer *>(userp);
+            if(transfer->body.empty())
+            {
+                transfer->started.set_value();
+                transfer->reloaded.wait();
+            }
+
+            transfer->body.append(static_cast<char *>(contents), size * nmemb);
+            return size * nmemb;
+        });
+        curl_easy_setopt(curlHandle, CURLOPT_WRITEDATA, &transfer);
+        CURLcode returnCode = curl_easy_perform(curlHandle);
+        EXPECT_EQ(returnCode, CURLE_OK) << curl_easy_strerror(returnCode);
+        curl_easy_cleanup(curlHandle);
+    });
+
+    ASSERT_EQ(transfer.started.get_future().wait_for(std::chrono::seconds(5)), std::future_status::ready);
+
+    // reload as on SIGHUP: nobody but the running request references the old configuration and its mapped file anymore
+    configuration = httpmock::MockConfiguration::load(newFileName);
+    mockServer.setGenerateResponseCallback(httpmock::MockConfiguration::responseCallback(configuration));
+    std::filesystem::remove(bodyFileName);
+    reloaded.set_value();
+    client.join();
+
+    EXPECT_EQ(transfer.body.size(), oldBody.size());
+    EXPECT_TRUE(transfer.body == oldBody);
+    EXPECT_TRUE(mockServer.waitForRequestCompleted(1, 1000));
+
+    Response response = request(mockServer.port(), "/data");
+    EXPECT_EQ(response.body, "new");
+    EXPECT_TRUE(mockServer.waitForRequestCompleted(1, 1000));
+
+    // released with the completed request: the old configuration doesn't outlive the reload
+    EXPECT_TRUE(oldConfiguration.expired());
+
+    std::filesystem::remove(oldFileName);
+    std::filesystem::remove(newFileName);
+}
@@ -0,0 +1,586 @@
+#include "include/httpmockserver/websocket.hpp"
+
+#include <array>
+#include <cstring>
+#include <algorithm>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+
+namespace httpmock
+{
+
+namespace
+{
+
+// larger frames are rejected with status code 1009 (message too big)
+const size_t maxFrameSize = 64 * 1024 * 1024;
+const size_t maxIovCount = IOV_MAX;
+
+uint32_t rotateLeft(uint32_t value, int bits)
+{
+    return (value << bits) | (value >> (32 - bits));
+}
+
+std::array<uint8_t, 20> sha1(const std::string &input)
+{
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+
+    std::string message = input;
+    const uint64_t bitLength = static_cast<uint64_t>(input.size()) * 8;
+    message.push_back(static_cast<char>(0x80));
+    while(message.size() % 64 != 56)
+        message.push_back('\0');
+    for(int i=7; i>=0; --i)
+        message.push_back(static_cast<char>((bitLength >> (i * 8)) & 0xff));
+
+    for(size_t chunk=0; chunk<message.size(); chunk+=64)
+    {
+        uint32_t w[80];
+        for(int i=0; i<16; ++i)
+        {
+            const unsigned char *p = reinterpret_cast<const unsigned char *>(&message[chunk + i * 4]);
+            w[i] = (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+        }
+        for(int i=16; i<80; ++i)
+            w[i] = rotateLeft(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for(int i=0; i<80; ++i)
+        {
+            uint32_t f, k;
+            if(i < 20)
+            {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            }
+            else if(i < 40)
+            {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            }
+            else if(i < 60)
+            {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            }
+            else
+            {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+
+            uint32_t temp = rotateLeft(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = rotateLeft(b, 30);
+            b = a;
+            a = temp;
+        }
+
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+
+    std::array<uint8_t, 20> digest;
+    for(int i=0; i<20; ++i)
+        digest[i] = static_cast<uint8_t>(h[i / 4] >> (24 - (i % 4) * 8));
+
+    return digest;
+}
+
+std::string base64(const uint8_t *data, size_t size)
+{
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    std::string output;
+    for(size_t i=0; i<size; i+=3)
+    {
+        uint32_t value = uint32_t(data[i]) << 16;
+        if(i + 1 < size)
+            value |= uint32_t(data[i + 1]) << 8;
+        if(i + 2 < size)
+            value |= uint32_t(data[i + 2]);
+
+        output.push_back(alphabet[(value >> 18) & 0x3f]);
+        output.push_back(alphabet[(value >> 12) & 0x3f]);
+        output.push_back((i + 1 < size) ? alphabet[(value >> 6) & 0x3f] : '=');
+        output.push_back((i + 2 < size) ? alphabet[value & 0x3f] : '=');
+    }
+
+    return output;
+}
+
+size_t encodeHeader(uint8_t *header, WebSocketOpcode opcode, size_t payloadSize)
+{
+    header[0] = 0x80 | static_cast<uint8_t>(opcode); // FIN, server frames are never masked
+    if(payloadSize < 126)
+    {
+        header[1] = static_cast<uint8_t>(payloadSize);
+        return 2;
+    }
+
+    if(payloadSize <= 0xffff)
+    {
+        header[1] = 126;
+        header[2] = static_cast<uint8_t>(payloadSize >> 8);
+        header[3] = static_cast<uint8_t>(payloadSize);
+        return 4;
+    }
+
+    header[1] = 127;
+    for(int i=0; i<8; ++i)
+        header[2 + i] = static_cast<uint8_t>(static_cast<uint64_t>(payloadSize) >> (56 - i * 8));
+    return 10;
+}
+
+void unmask(std::byte *data, size_t size, const uint8_t *maskingKey)
+{
+    // 8 bytes at once; the key repeats every 4 bytes
+    uint8_t key8[8];
+    for(int i=0; i<8; ++i)
+        key8[i] = maskingKey[i % 4];
+    uint64_t key64;
+    std::memcpy(&key64, key8, sizeof(key64));
+
+    size_t i = 0;
+    for(; i + 8 <= size; i+=8)
+    {
+        uint64_t chunk;
+        std::memcpy(&chunk, data + i, sizeof(chunk));
+        chunk ^= key64;
+        std::memcpy(data + i, &chunk, sizeof(chunk));
+    }
+
+    for(; i<size; ++i)
+        data[i] ^= std::byte{maskingKey[i % 4]};
+}
+
+}
+
+WebSocketFrame::WebSocketFrame(WebSocketOpcode opcode, const void *data, size_t size)
+ : m_payloadSize(size)
+{
+    uint8_t header[10];
+    size_t headerSize = encodeHeader(header, opcode, size);
+
+    m_encoded.resize(headerSize + size);
+    std::memcpy(m_encoded.data(), header, headerSize);
+    if(size)
+        std::memcpy(m_encoded.data() + headerSize, data, size);
+}
+
+WebSocketFrame::WebSocketFrame(const std::string &text)
+ : WebSocketFrame(WebSocketOpcode::Text, text.data(), text.size())
+{
+}
+
+const std::vector<std::byte> &WebSocketFrame::encoded() const
+{
+    return m_encoded;
+}
+
+size_t WebSocketFrame::payloadSize() const
+{
+    return m_payloadSize;
+}
+
+WebSocketSession::WebSocketSession(const std::string &url, MHD_socket socket, MHD_UpgradeResponseHandle *upgradeHandle, const webSocketMessageCallback &onMessage,
+                                   unsigned sendTimeoutMs)
+ : m_url(url)
+ , m_socket(socket)
+ , m_upgradeHandle(upgradeHandle)
+ , m_onMessage(onMessage)
+ , m_sendTimeoutMs(sendTimeoutMs)
+ , m_readBuffer(65536)
+{
+}
+
+WebSocketSession::~WebSocketSession()
+{
+    terminate();
+}
+
+void WebSocketSession::start(const char *extraIn, size_t extraInSize)
+{
+    // we do blocking I/O in our own thread
+    int flags = fcntl(m_socket, F_GETFL);
+    if(flags >= 0)
+        fcntl(m_socket, F_SETFL, flags & ~O_NONBLOCK);
+
+    // a blocking write fails with EAGAIN after the timeout
+    if(m_sendTimeoutMs > 0)
+    {
+        struct timeval timeout{};
+        timeout.tv_sec = m_sendTimeoutMs / 1000;
+        timeout.tv_usec = (m_sendTimeoutMs % 1000) * 1000;
+        setsockopt(m_socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    }
+
+    if(extraInSize > m_readBuffer.size())
+        m_readBuffer.resize(extraInSize);
+    if(extraInSize)
+        std::memcpy(m_readBuffer.data(), extraIn, extraInSize);
+    m_readBufferFill = extraInSize;
+
+    m_readThread = std::thread([self = shared_from_this()]
+    {
+        self->readLoop();
+    });
+}
+
+const std::string &WebSocketSession::url() const
+{
+    return m_url;
+}
+
+bool WebSocketSession::isOpen() const
+{
+    return m_open;
+}
+
+bool WebSocketSession::sendText(const std::string &text)
+{
+    return sendFrame(WebSocketOpcode::Text, text.data(), text.size());
+}
+
+bool WebSocketSession::sendBinary(const void *data, size_t size)
+{
+    return sendFrame(WebSocketOpcode::Binary, data, size);
+}
+
+bool WebSocketSession::send(const WebSocketFrame &frame, size_t count)
+{
+    std::array<struct iovec, maxIovCount> iov;
+    void *encoded = const_cast<std::byte *>(frame.encoded().data());
+    const size_t encodedSize = frame.encoded().size();
+
+    std::lock_guard<std::mutex> lock(m_sendMutex);
+    if(!m_open || m_closeSent)
+        return false;
+
+    for(size_t sent=0; sent<count; )
+    {
+        const size_t batch = std::min(count - sent, maxIovCount);
+        for(size_t i=0; i<batch; ++i)
+            iov[i] = {encoded, encodedSize};
+
+        if(!writeAll(iov.data(), static_cast<int>(batch)))
+            return false;
+
+        sent += batch;
+        m_sentFrames += batch;
+        m_sentBytes += batch * frame.payloadSize();
+    }
+
+    return true;
+}
+
+void WebSocketSession::close(uint16_t statusCode)
+{
+    uint8_t payload[2] = {static_cast<uint8_t>(statusCode >> 8), static_cast<uint8_t>(statusCode)};
+    sendFrame(WebSocketOpcode::Close, payload, sizeof(payload));
+}
+
+uint64_t WebSocketSession::receivedFrames() const
+{
+    return m_receivedFrames;
+}
+
+uint64_t WebSocketSession::receivedBytes() const
+{
+    return m_receivedBytes;
+}
+
+uint64_t WebSocketSession::sentFrames() const
+{
+    return m_sentFrames;
+}
+
+uint64_t WebSocketSession::sentBytes() const
+{
+    return m_sentBytes;
+}
+
+std::string WebSocketSession::acceptKey(const std::string &clientKey)
+{
+    std::array<uint8_t, 20> digest = sha1(clientKey + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11");
+    return base64(digest.data(), digest.size());
+}
+
+void WebSocketSession::terminate()
+{
+    // going away; a sender, which is stuck at a stalled peer, is woken up by the shutdown instead of being waited for
+    uint8_t payload[2] = {1001 >> 8, 1001 & 0xff};
+    sendFrame(WebSocketOpcode::Close, payload, sizeof(payload), false);
+    shutdownSocket();
+
+    // the read thread releases its own reference last: then it destroys the session and can't wait for itself
+    if(m_readThread.joinable())
+    {
+        if(m_readThread.get_id() == std::this_thread::get_id())
+            m_readThread.detach();
+        else
+            m_readThread.join();
+    }
+}
+
+void WebSocketSession::readLoop()
+{
+    bool closeReceived = false;
+    while(!closeReceived)
+    {
+        // process all complete frames of the buffer before reading again
+        size_t position = 0;
+        while(!closeReceived && (position < m_readBufferFill))
+        {
+            size_t consumed = processFrame(m_readBuffer.data() + position, m_readBufferFill - position, closeReceived);
+            if(consumed == 0)
+                break;
+
+            position += consumed;
+        }
+
+        if(closeReceived)
+            break;
+
+        if(position > 0)
+        {
+            std::memmove(m_readBuffer.data(), m_readBuffer.data() + position, m_readBufferFill - position);
+            m_readBufferFill -= position;
+        }
+
+        // an incomplete frame, which doesn't fit into the buffer
+        if(m_readBufferFill == m_readBuffer.size())
+            m_readBuffer.resize(m_readBuffer.size() * 2);
+
+        ssize_t received = ::recv(m_socket, m_readBuffer.data() + m_readBufferFill, m_readBuffer.size() - m_readBufferFill, 0);
+        if(received < 0 && errno == EINTR)
+            continue;
+
+        if(received <= 0)
+            break;
+
+        m_readBufferFill += static_cast<size_t>(received);
+    }
+
+    // New senders give up from now on, and a running one finishes (at the latest after the send timeout),
+    // before the socket belongs to libmicrohttpd again with MHD_UPGRADE_ACTION_CLOSE.
+    m_open = false;
+    {
+        std::lock_guard<std::mutex> sendLock(m_sendMutex);
+        std::lock_guard<std::mutex> socketLock(m_socketMutex);
+        m_socketReleased = true;
+        MHD_upgrade_action(m_upgradeHandle, MHD_UPGRADE_ACTION_CLOSE);
+    }
+
+    if(m_onFinished)
+        m_onFinished(*this);
+}
+
+size_t WebSocketSession::processFrame(std::byte *data, size_t size, bool &closeReceived)
+{
+    if(size < 2)
+        return 0;
+
+    const uint8_t byte0 = static_cast<uint8_t>(data[0]);
+    const uint8_t byte1 = static_cast<uint8_t>(data[1]);
+    const bool fin = byte0 & 0x80;
+    const uint8_t reserved = byte0 & 0x70;
+    const WebSocketOpcode opcode = static_cast<WebSocketOpcode>(byte0 & 0x0f);
+    const bool control = byte0 & 0x08;
+    const bool masked = byte1 & 0x80;
+
+    size_t headerSize = 2;
+    uint64_t payloadSize = byte1 & 0x7f;
+    if(payloadSize == 126)
+    {
+        headerSize = 4;
+        if(size < headerSize)
+            return 0;
+
+        payloadSize = (uint64_t(data[2]) << 8) | uint64_t(data[3]);
+    }
+    else if(payloadSize == 127)
+    {
+        headerSize = 10;
+        if(size < headerSize)
+            return 0;
+
+        payloadSize = 0;
+        for(int i=0; i<8; ++i)
+            payloadSize = (payloadSize << 8) | uint64_t(data[2 + i]);
+    }
+
+    // fails the connection: the rest of the buffer is dropped
+    auto fail = [&](uint16_t statusCode)
+    {
+        close(statusCode);
+        closeReceived = true;
+        return size;
+    };
+
+    // the header is checked before the payload has been received completely (1002: protocol error, 1009: message too big)
+    const bool fragmentPending = (m_fragmentedOpcode != WebSocketOpcode::Continuation);
+    switch(opcode)
+    {
+    case WebSocketOpcode::Text:
+    case WebSocketOpcode::Binary:
+        if(fragmentPending)
+            return fail(1002); // a new message before the end of the fragmented one
+        break;
+    case WebSocketOpcode::Continuation:
+        if(!fragmentPending)
+            return fail(1002);
+        if(m_fragmentedMessage.size() + payloadSize > maxFrameSize)
+            return fail(1009);
+        break;
+    case WebSocketOpcode::Close:
+    case WebSocketOpcode::Ping:
+    case WebSocketOpcode::Pong:
+        break;
+    default:
+        return fail(1002); // reserved opcode
+    }
+
+    // no extension is negotiated, client frames must be masked, and control frames are neither fragmented nor long
+    if(reserved || !masked || (control && (!fin || (payloadSize > 125))) || ((opcode == WebSocketOpcode::Close) && (payloadSize == 1)))
+        return fail(1002);
+    if(payloadSize > maxFrameSize)
+        return fail(1009);
+
+    const uint8_t *maskingKey = reinterpret_cast<const uint8_t *>(data + headerSize);
+    headerSize += 4;
+    if(size < headerSize + payloadSize)
+        return 0;
+
+    std::byte *payload = data + headerSize;
+    unmask(payload, payloadSize, maskingKey);
+
+    m_receivedFrames++;
+    m_receivedBytes += payloadSize;
+
+    switch(opcode)
+    {
+    case WebSocketOpcode::Text:
+    case WebSocketOpcode::Binary:
+        if(fin)
+        {
+            if(m_onMessage)
+                m_onMessage(*this, opcode, payload, payloadSize);
+        }
+        else
+        {
+            m_fragmentedOpcode = opcode;
+            m_fragmentedMessage.assign(payload, payload + payloadSize);
+        }
+        break;
+    case WebSocketOpcode::Continuation:
+        m_fragmentedMessage.insert(m_fragmentedMessage.end(), payload, payload + payloadSize);
+        if(fin)
+        {
+            if(m_onMessage)
+                m_onMessage(*this, m_fragmentedOpcode, m_fragmentedMessage.data(), m_fragmentedMessage.size());
+            m_fragmentedOpcode = WebSocketOpcode::Continuation;
+            m_fragmentedMessage.clear();
+        }
+        break;
+    case WebSocketOpcode::Ping:
+        sendFrame(WebSocketOpcode::Pong, payload, payloadSize);
+        break;
+    case WebSocketOpcode::Pong:
+        break;
+    default: // Close: echo the status code of the client (the payload is empty or starts with the code)
+        sendFrame(WebSocketOpcode::Close, payload, std::min<uint64_t>(payloadSize, 2));
+        closeReceived = true;
+        break;
+    }
+
+    return headerSize + payloadSize;
+}
+
+bool WebSocketSession::sendFrame(WebSocketOpcode opcode, const void *data, size_t size, bool waitForSender)
+{
+    uint8_t header[10];
+    struct iovec iov[2];
+    iov[0] = {header, encodeHeader(header, opcode, size)};
+    iov[1] = {const_cast<void *>(data), size};
+
+    std::unique_lock<std::mutex> lock(m_sendMutex, std::defer_lock);
+    if(waitForSender)
+        lock.lock();
+    else if(!lock.try_lock())
+        return false;
+
+    if(!m_open || m_closeSent)
+        return false;
+
+    if(opcode == WebSocketOpcode::Close)
+        m_closeSent = true;
+
+    if(!writeAll(iov, size ? 2 : 1))
+        return false;
+
+    m_sentFrames++;
+    m_sentBytes += size;
+    return true;
+}
+
+bool WebSocketSession::writeAll(struct iovec *iov, int iovCount)
+{
+    while(iovCount > 0)
+    {
+        struct msghdr message{};
+        message.msg_iov = iov;
+        message.msg_iovlen = static_cast<size_t>(iovCount);
+
+        ssize_t written = ::sendmsg(m_socket, &message, MSG_NOSIGNAL);
+        if(written < 0)
+        {
+            if(errno == EINTR)
+                continue;
+
+            // send timeout: the peer doesn't read anymore, so further senders must not wait for it again
+            if((errno == EAGAIN) || (errno == EWOULDBLOCK))
+            {
+                m_open = false;
+                shutdownSocket();
+            }
+
+            return false;
+        }
+
+        size_t remaining = static_cast<size_t>(written);
+        while((iovCount > 0) && (remaining >= iov->iov_len))
+        {
+            remaining -= iov->iov_len;
+            ++iov;
+            --iovCount;
+        }
+
+        if(iovCount > 0)
+        {
+            iov->iov_base = static_cast<char *>(iov->iov_base) + remaining;
+            iov->iov_len -= remaining;
+        }
+    }
+
+    return true;
+}
+
+void WebSocketSession::shutdownSocket()
+{
+    // wakes up the read thread and a blocked sender; only valid as long as the socket hasn't been handed back to libmicrohttpd
+    std::lock_guard<std::mutex> lock(m_socketMutex);
+    if(!m_socketReleased)
+        ::shutdown(m_socket, SHUT_RDWR);
+}
+
+}